@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+#
+# the end-to-end benchmark behind make bench: runs subberthehut against the
+# stand-in server of server.py over a corpus of sparse synthetic videos, and
+# reports the files per second and the latency percentiles of every phase,
+# taken from the per-file numbers of --stats.
+
+import argparse
+import json
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+PHASES = ('hash', 'search', 'download', 'decode')
+
+
+def make_corpus(directory, count, size):
+	"""sparse videos of size bytes whose hashes differ, named like releases."""
+	paths = []
+	for i in range(count):
+		path = os.path.join(directory, 'Bench.Movie.%d.2010.720p.BluRay.x264.mkv' % i)
+		with open(path, 'wb') as f:
+			# the hash sums up the first and the last 64 KiB, the rest stays a hole
+			f.write(struct.pack('<Q', i + 1))
+			f.truncate(size)
+		paths.append(path)
+	return paths
+
+
+def percentile(values, p):
+	"""nearest-rank percentile of the sorted values."""
+	if not values:
+		return 0.0
+	rank = max(1, -(-len(values) * p // 100))
+	return values[int(rank) - 1]
+
+
+def main():
+	parser = argparse.ArgumentParser(description='End-to-end benchmark of subberthehut.')
+	parser.add_argument('--binary', default='./subberthehut', help='the subberthehut to benchmark')
+	parser.add_argument('--files', type=int, default=500, help='number of videos (default: 500)')
+	parser.add_argument('--size', type=int, default=700 << 20, help='bytes per video (default: 700 MiB)')
+	parser.add_argument('--latency', type=float, default=50, help='milliseconds per call of the server (default: 50)')
+	parser.add_argument('--results', type=int, default=10, help='results per search query (default: 10)')
+	parser.add_argument('--payload-size', type=int, default=60000, help='bytes per subtitle (default: 60000)')
+	parser.add_argument('--keep', action='store_true', help="don't remove the corpus and the stats")
+	parser.add_argument('args', nargs='*', help='more options for subberthehut, after --')
+	args = parser.parse_args()
+
+	binary = os.path.abspath(args.binary)
+	work = tempfile.mkdtemp(prefix='subberthehut-bench.')
+	server = None
+	try:
+		corpus = os.path.join(work, 'corpus')
+		os.mkdir(corpus)
+		files = make_corpus(corpus, args.files, args.size)
+
+		server = subprocess.Popen([sys.executable, os.path.join(os.path.dirname(__file__), 'server.py'),
+		                           '--latency', str(args.latency), '--results', str(args.results),
+		                           '--payload-size', str(args.payload_size)],
+		                          stdout=subprocess.PIPE, text=True)
+		url = server.stdout.readline().strip()
+		if not url:
+			print('the stand-in server failed to start', file=sys.stderr)
+			return 1
+
+		# a cache of its own, so that neither a session nor results of earlier runs are reused
+		env = dict(os.environ, XDG_CACHE_HOME=os.path.join(work, 'cache'))
+		stats_path = os.path.join(work, 'stats.json')
+		command = [binary, '--server', url, '--never-ask', '--no-exit-on-fail', '-q', '-q',
+		           '--no-hash-cache', '--no-search-cache', '--rate-limit', '1000000',
+		           '--stats', stats_path] + args.args + files
+
+		started = time.monotonic()
+		r = subprocess.call(command, env=env, stdout=subprocess.DEVNULL)
+		wall = time.monotonic() - started
+		if r != 0:
+			print('warning: subberthehut exited with %d' % r, file=sys.stderr)
+
+		with open(stats_path) as f:
+			stats = json.load(f)
+	finally:
+		if server:
+			server.terminate()
+			server.wait()
+		if args.keep:
+			print('corpus and stats kept in %s' % work, file=sys.stderr)
+		else:
+			shutil.rmtree(work, ignore_errors=True)
+
+	per_file = stats['per_file']
+	failed = sum(1 for f in per_file if f['result'] != 0)
+	print('%d files (%d failed) in %.3f s: %.1f files/s' % (len(per_file), failed, wall, len(per_file) / wall))
+	print('%-10s %10s %10s %10s %10s' % ('phase', 'p50 ms', 'p90 ms', 'p99 ms', 'max ms'))
+	for phase in PHASES:
+		values = sorted(f['%s_seconds' % phase] * 1000 for f in per_file)
+		print('%-10s %10.2f %10.2f %10.2f %10.2f' % (phase, percentile(values, 50), percentile(values, 90),
+		                                             percentile(values, 99), values[-1] if values else 0))
+	login = stats['phases']['login']
+	print('login: %d call(s), %.2f ms' % (login['count'], login['seconds'] * 1000))
+	return 1 if r != 0 else 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
@@ -0,0 +1,168 @@
+/*
+ * the throughput of decoding downloaded subtitles, without a server: base64
+ * decoding, inflating and recoding a generated subtitle, and writing it to a
+ * file, each measured on its own. All rates are in MB/s of the decoded
+ * subtitle, so that the stages compare. The size of the subtitle is the
+ * argument, 1 MiB by default.
+ *
+ * The stages are static functions of the library, so it is included instead
+ * of being linked. Built and run by make bench.
+ */
+
+#include "../libsubberthehut.c"
+
+#define BENCH_MIN_SECONDS 0.5
+
+// a sink which only counts, so that writing doesn't count as decoding
+static int null_sink_write(void *data, const void *buf, size_t len) {
+	(void) buf;
+	*(uint64_t *) data += len;
+	return 0;
+}
+
+/*
+ * an SRT of size bytes with CRLF line ends and a few Latin-1 characters,
+ * so that recoding has something to do.
+ */
+static unsigned char *make_subtitle(size_t size) {
+	unsigned char *sub = malloc(size + 128);
+	if (!sub)
+		return NULL;
+
+	size_t len = 0;
+	for (int n = 1; len < size; n++) {
+		len += sprintf((char *) sub + len,
+		               "%d\r\n00:%02d:%02d,000 --> 00:%02d:%02d,500\r\nLine %d, caf\xe9 na\xefve.\r\n\r\n",
+		               n, n / 60 % 60, n % 60, n / 60 % 60, n % 60, n);
+	}
+	return sub;
+}
+
+static unsigned char *gzip_buf(const unsigned char *in, size_t len, size_t *out_len) {
+	z_stream z = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+
+	// 16+MAX_WBITS writes a gzip header, like the server sends
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	size_t capacity = deflateBound(&z, len);
+	unsigned char *out = malloc(capacity);
+	if (!out) {
+		deflateEnd(&z);
+		return NULL;
+	}
+
+	z.next_in = (unsigned char *) in;
+	z.avail_in = len;
+	z.next_out = out;
+	z.avail_out = capacity;
+	int r = deflate(&z, Z_FINISH);
+	*out_len = capacity - z.avail_out;
+	deflateEnd(&z);
+	if (r != Z_STREAM_END) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+static void report(const char *stage, size_t size, int iterations, double seconds) {
+	printf("%-24s %10.1f MB/s %8.3f ms per subtitle\n", stage,
+	       size * (double) iterations / seconds / 1e6, seconds / iterations * 1000);
+}
+
+int main(int argc, char *argv[]) {
+	size_t size = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024 * 1024;
+	struct sth_context ctx = { 0 };
+	_cleanup_free_ unsigned char *sub = NULL;
+	_cleanup_free_ unsigned char *sub_gz = NULL;
+	_cleanup_free_ char *sub_base64 = NULL;
+	_cleanup_free_ char *work = NULL;
+	size_t sub_gz_len;
+	int iterations;
+	double started;
+	int r = 0;
+
+	if (size == 0) {
+		fprintf(stderr, "usage: %s [size of the subtitle in bytes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	sth_options_init(&ctx.options);
+
+	sub = make_subtitle(size);
+	sub_gz = sub ? gzip_buf(sub, size, &sub_gz_len) : NULL;
+	gchar *encoded = sub_gz ? g_base64_encode(sub_gz, sub_gz_len) : NULL;
+	sub_base64 = encoded ? strdup(encoded) : NULL;
+	g_free(encoded);
+	work = sub_base64 ? malloc(strlen(sub_base64) + 1) : NULL;
+	if (!work) {
+		fputs("failed to generate the subtitle.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	size_t base64_len = strlen(sub_base64);
+
+	printf("subtitle: %zu bytes, %zu gzipped, %zu base64 encoded\n", size, sub_gz_len, base64_len);
+
+	// base64, decoded in place like download_done() does
+	started = stats_now();
+	for (iterations = 0; stats_now() - started < BENCH_MIN_SECONDS; iterations++) {
+		memcpy(work, sub_base64, base64_len + 1);
+		gsize len = base64_len;
+		g_base64_decode_inplace(work, &len);
+		if (len != sub_gz_len) {
+			fputs("base64 decoding failed.\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}
+	report("base64", size, iterations, stats_now() - started);
+
+	// inflate, as it is written unchanged
+	uint64_t counted = 0;
+	struct sth_sink null_sink = { .write = null_sink_write, .data = &counted };
+	started = stats_now();
+	for (iterations = 0; r == 0 && stats_now() - started < BENCH_MIN_SECONDS; iterations++) {
+		uint64_t written;
+		r = sub_write(&ctx, sub_gz, sub_gz_len, &null_sink, NULL, &written);
+	}
+	report("inflate", size, iterations, stats_now() - started);
+
+	// inflate and recode, like --utf8 --unix-newlines --strip-bom
+	ctx.options.utf8 = ctx.options.unix_newlines = ctx.options.strip_bom = true;
+	started = stats_now();
+	for (iterations = 0; r == 0 && stats_now() - started < BENCH_MIN_SECONDS; iterations++) {
+		uint64_t written;
+		r = sub_write(&ctx, sub_gz, sub_gz_len, &null_sink, "CP1252", &written);
+	}
+	report("inflate+recode", size, iterations, stats_now() - started);
+	ctx.options.utf8 = ctx.options.unix_newlines = ctx.options.strip_bom = false;
+
+	// all of it, into a file
+	char path[] = "/tmp/subberthehut-decode.XXXXXX";
+	_cleanup_close_ int fd = mkstemp(path);
+	if (fd == -1) {
+		fprintf(stderr, "failed to create %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	unlink(path);
+	struct sth_sink fd_sink = { .write = fd_sink_write, .data = &fd };
+	started = stats_now();
+	for (iterations = 0; r == 0 && stats_now() - started < BENCH_MIN_SECONDS; iterations++) {
+		uint64_t written;
+		memcpy(work, sub_base64, base64_len + 1);
+		gsize len = base64_len;
+		const unsigned char *gz = g_base64_decode_inplace(work, &len);
+		if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1)
+			r = errno;
+		if (r == 0)
+			r = sub_write(&ctx, gz, len, &fd_sink, NULL, &written);
+	}
+	report("base64+inflate+write", size, iterations, stats_now() - started);
+
+	if (r != 0) {
+		fprintf(stderr, "decoding failed: %d\n", r);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
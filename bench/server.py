@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+#
+# a stand-in for the XML-RPC API of OpenSubtitles.org, so that subberthehut can
+# be benchmarked and tested without the real service, see bench.py. It answers
+# LogIn, NoOperation, SearchSubtitles, DownloadSubtitles and GetSubLanguages
+# after a configurable latency, with as many results and as large subtitles as
+# asked for. The URL it listens on is printed as the first line on stdout.
+
+import argparse
+import base64
+import gzip
+import socketserver
+import sys
+import time
+import zlib
+from xmlrpc.server import SimpleXMLRPCRequestHandler, SimpleXMLRPCServer
+
+LANGUAGES = [
+	('eng', 'English'), ('ger', 'German'), ('fre', 'French'), ('spa', 'Spanish'),
+	('ita', 'Italian'), ('por', 'Portuguese'), ('pob', 'Portuguese (BR)'), ('dut', 'Dutch'),
+	('pol', 'Polish'), ('rus', 'Russian'), ('cze', 'Czech'), ('swe', 'Swedish'),
+]
+
+
+class Handler(SimpleXMLRPCRequestHandler):
+	# keep the connection alive between calls, like the real server does
+	protocol_version = 'HTTP/1.1'
+	# accept any path, the client posts to that of its --server URL
+	rpc_paths = ()
+
+	def log_message(self, format, *args):
+		pass
+
+
+class Server(socketserver.ThreadingMixIn, SimpleXMLRPCServer):
+	daemon_threads = True
+	# many clients connect at once when --max-inflight is high
+	request_queue_size = 128
+
+
+def make_subtitle(size):
+	"""an SRT of about size bytes, gzipped and base64 encoded like the API does."""
+	cues = []
+	length = 0
+	n = 0
+	while length < size:
+		n += 1
+		cue = '%d\n00:%02d:%02d,000 --> 00:%02d:%02d,500\nLine %d of a subtitle for the benchmark.\n\n' % (
+			n, n // 60 % 60, n % 60, n // 60 % 60, n % 60, n)
+		cues.append(cue)
+		length += len(cue)
+	data = ''.join(cues).encode()[:size]
+	return base64.b64encode(gzip.compress(data)).decode()
+
+
+class API:
+	def __init__(self, args):
+		self.args = args
+		self.subtitle = make_subtitle(args.payload_size)
+		self.logins = 0
+
+	def wait(self):
+		if self.args.latency > 0:
+			time.sleep(self.args.latency / 1000)
+
+	def LogIn(self, username, password, language, useragent):
+		self.wait()
+		self.logins += 1
+		return {'status': '200 OK', 'token': 'bench%d' % self.logins, 'seconds': 0.0}
+
+	def NoOperation(self, token):
+		self.wait()
+		return {'status': '200 OK', 'seconds': 0.0}
+
+	def SearchSubtitles(self, token, queries, params=None):
+		self.wait()
+		limit = self.args.results
+		if params and 'limit' in params:
+			limit = min(limit, int(params['limit']))
+
+		data = []
+		for number, query in enumerate(queries):
+			lang = query.get('sublanguageid', 'eng').split(',')[0]
+			if lang == 'all':
+				lang = 'eng'
+			by_hash = 'moviehash' in query
+			key = query['moviehash'] + query.get('moviebytesize', '') if by_hash else query.get('query', '')
+			for i in range(limit):
+				# the same query always gets the same IDs, just like from the real server
+				sub_id = zlib.crc32(('%s/%d' % (key, i)).encode()) & 0x7fffffff
+				result = {
+					'QueryNumber': str(number),
+					'IDSubtitleFile': str(sub_id),
+					'MatchedBy': 'moviehash' if by_hash else 'fulltext',
+					'SubLanguageID': lang,
+					'MovieReleaseName': 'Bench.Movie.%d.2010.720p.BluRay' % i,
+					'SubFileName': 'Bench.Movie.%d.2010.720p.BluRay.srt' % i,
+					'MovieFPS': '23.976',
+					'SubDownloadsCnt': str(1000 - i),
+					'SubRating': '0.0',
+					'UserRank': '',
+					'SubBad': '0',
+					'SubEncoding': 'UTF-8',
+				}
+				if by_hash:
+					result['MovieHash'] = query['moviehash']
+					result['MovieByteSize'] = query.get('moviebytesize', '0')
+				data.append(result)
+
+		return {'status': '200 OK', 'data': data, 'seconds': 0.0}
+
+	def DownloadSubtitles(self, token, ids):
+		self.wait()
+		data = [{'idsubtitlefile': str(sub_id), 'data': self.subtitle} for sub_id in ids]
+		return {'status': '200 OK', 'data': data, 'seconds': 0.0}
+
+	def GetSubLanguages(self, language='en'):
+		self.wait()
+		data = [{'SubLanguageID': code, 'LanguageName': name, 'ISO639': code[:2]} for code, name in LANGUAGES]
+		return {'status': '200 OK', 'data': data, 'seconds': 0.0}
+
+
+def main():
+	parser = argparse.ArgumentParser(description='Stand-in OpenSubtitles.org XML-RPC server.')
+	parser.add_argument('--port', type=int, default=0, help='port to listen on, any free one by default')
+	parser.add_argument('--latency', type=float, default=50, help='milliseconds each call takes (default: 50)')
+	parser.add_argument('--results', type=int, default=10, help='results per search query (default: 10)')
+	parser.add_argument('--payload-size', type=int, default=60000,
+	                    help='bytes of every subtitle before compression (default: 60000)')
+	args = parser.parse_args()
+
+	server = Server(('127.0.0.1', args.port), Handler, logRequests=False, allow_none=True)
+	server.register_instance(API(args))
+	print('http://127.0.0.1:%d/xml-rpc' % server.server_address[1], flush=True)
+	try:
+		server.serve_forever()
+	except KeyboardInterrupt:
+		pass
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
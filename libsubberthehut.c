@@ -0,0 +1,4872 @@
+/*
+ * Copyright 2015 Marius Thesing
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <inttypes.h> // uint64_t / PRIx64
+#include <limits.h> // NAME_MAX
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h> // flock
+#include <sys/ioctl.h>
+#include <linux/fs.h> // FICLONE
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <iconv.h>
+
+#include <xmlrpc-c/base.h>
+#include <xmlrpc-c/client.h>
+#include <curl/curl.h>
+#include <glib.h> // g_base64_decode_inplace, g_compute_checksum_for_data
+#include <zlib.h>
+
+#include "libsubberthehut.h"
+
+#define LOGIN_LANGCODE         "en"
+#define LOGIN_USER_AGENT       "subberthehut v" VERSION
+
+// OpenSubtitles.org expires tokens after 15 minutes of inactivity
+#define SESSION_IDLE_TIMEOUT   (15 * 60)
+// refresh a reused token with NoOperation when it was idle for this long
+#define SESSION_REFRESH_AFTER  (10 * 60)
+
+// subtitles are inflated into a buffer of this size, which is written when full
+#define ZLIB_CHUNK             (1024 * 1024)
+
+// hash cache: open addressing table in $XDG_CACHE_HOME/subberthehut/hashes
+#define HASH_CACHE_MAGIC       "sthhash2" // bumped when the hashes change
+#define HASH_CACHE_SLOTS       (1 << 16)
+#define HASH_CACHE_PROBES      8
+#define INDEX_MAGIC            "sthidx1"
+// searches without results are retried sooner, subtitles may be uploaded
+#define SEARCH_CACHE_EMPTY_TTL (60 * 60)
+// how often the expired entries of the search cache and the blob store are removed
+#define CACHE_SWEEP_INTERVAL   (24 * 60 * 60)
+// subtitles of the blob store which weren't used for this long are removed
+#define BLOB_STORE_TTL         (90 * 24 * 60 * 60)
+#define INDEX_FILE             "index"
+#define INDEX_MANIFEST_FILE    "manifest.tsv"
+
+// size of the two windows at the beginning and the end of a file the hash is built from
+#define HASH_CHUNK             (64 * 1024)
+
+// maximum number of IDs OpenSubtitles.org accepts per DownloadSubtitles call
+#define DOWNLOAD_CHUNK         20
+
+// for the responses parsed by xmlrpc-c, scanned responses aren't limited
+#define STH_XMLRPC_SIZE_LIMIT  (10 * 1024 * 1024)
+
+// OpenSubtitles.org allows 40 requests per 10 seconds and IP address
+#define RATE_LIMIT_REQUESTS    40
+#define RATE_LIMIT_WINDOW      10
+// requests per second the rate is never lowered below, and added per success
+#define RATE_MIN               0.1
+#define RATE_INCREASE          0.05
+
+// throttled or transient failures are retried after 1, 2, 4, ... seconds (plus jitter)
+#define RPC_MAX_ATTEMPTS       6
+#define RPC_BACKOFF_BASE       1.0
+#define RPC_BACKOFF_MAX        60.0
+
+// weights of the ranking of search results, a score is at most 100
+#define SCORE_HASH             STH_SCORE_HASH
+#define SCORE_SIMILARITY       30 // to the name of the video
+#define SCORE_FPS              5  // same frame rate as the hash matches
+#define SCORE_DOWNLOADS        5  // reached at 10000 downloads
+#define SCORE_RATING           5
+#define SCORE_UPLOADER         5
+#define SCORE_BAD              25 // subtracted if reported as bad
+
+/* __attribute__(cleanup) */
+#define _cleanup_free_    __attribute__((cleanup(cleanup_free)))
+#define _cleanup_fclose_  __attribute__((cleanup(cleanup_fclose)))
+#define _cleanup_close_   __attribute__((cleanup(cleanup_close)))
+#define _cleanup_xmlrpc_  __attribute__((cleanup(cleanup_xmlrpc_DECREF)))
+#define _cleanup_env_     __attribute__((cleanup(xmlrpc_env_clean)))
+
+static void cleanup_free(void *p) {
+	free(*(void**)p);
+}
+
+static void cleanup_fclose(FILE **p) {
+	if(*p)
+		fclose(*p);
+}
+
+static void cleanup_close(int *p) {
+	if (*p >= 0)
+		close(*p);
+}
+
+static void cleanup_xmlrpc_DECREF(xmlrpc_value **p) {
+	if(*p)
+		xmlrpc_DECREF(*p);
+}
+/* end __attribute__(cleanup) */
+
+static void (*log_fn)(enum sth_log_level level, const char *message, void *data);
+static void *log_data;
+// the hash workers log as well, one message at a time
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sth_set_log(void (*log)(enum sth_log_level level, const char *message, void *data), void *data) {
+	log_fn = log;
+	log_data = data;
+}
+
+static void log_message(enum sth_log_level level, const char *format, va_list args) {
+	// without a callback, only errors are written, to stderr
+	if (!log_fn && level != STH_LOG_ERR)
+		return;
+
+	char *message;
+	if (vasprintf(&message, format, args) == -1)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+	if (log_fn)
+		log_fn(level, message, log_data);
+	else
+		fprintf(stderr, "%s\n", message);
+	pthread_mutex_unlock(&log_lock);
+
+	free(message);
+}
+
+static void log_err(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	log_message(STH_LOG_ERR, format, args);
+	va_end(args);
+}
+
+static void log_info(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	log_message(STH_LOG_INFO, format, args);
+	va_end(args);
+}
+
+static int log_oom() {
+	log_err("Out of Memory.");
+	return ENOMEM;
+}
+
+/*
+ * --stats: time spent per phase and a few counters, collected per context
+ * and written by sth_stats_write().
+ */
+enum stats_phase {
+	STATS_HASH,
+	STATS_LOGIN,
+	STATS_SEARCH,
+	STATS_DOWNLOAD,
+	STATS_DECODE, // base64 decoding, inflating and writing a subtitle
+	STATS_PHASES
+};
+
+static const char *const stats_phase_names[STATS_PHASES] = {
+	"hash", "login", "search", "download", "decode"
+};
+
+// upper bounds of the latency histogram buckets, in seconds
+static const double stats_buckets[] = {
+	0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+#define STATS_BUCKETS (sizeof(stats_buckets) / sizeof(stats_buckets[0]))
+
+struct stats_histogram {
+	uint64_t count;
+	double sum;
+	double max;
+	uint64_t buckets[STATS_BUCKETS + 1]; // the last one is +Inf
+	uint64_t response_bytes;             // serialized size of the responses
+};
+
+struct stats_file {
+	char *filepath;
+	int r;
+	double seconds[STATS_PHASES]; // login is never attributed to a file
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+};
+
+struct stats {
+	double started;
+	struct stats_histogram phases[STATS_PHASES];
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t hash_cache_hits;
+	uint64_t search_cache_hits;
+	uint64_t index_hits;
+	uint64_t blob_hits;
+	uint64_t duplicates;         // files sharing the search of an identical one
+	uint64_t failed;
+	uint64_t retries;
+	uint64_t throttled;
+	uint64_t connections;        // opened by the streamed calls
+	uint64_t connections_reused;
+
+	struct stats_file *files;
+	int file_count;
+	int file_capacity;
+};
+
+/*
+ * every request to the server takes a token from this bucket, which holds
+ * up to rate_limit tokens and is refilled with rate tokens per second.
+ * rate starts at what the server allows; it is halved whenever the server
+ * throttles us and grows back slowly with every success (AIMD), so that
+ * a long run stays close to the throughput that is actually allowed.
+ */
+struct rate_bucket {
+	double capacity;
+	double max_rate;
+	double rate;
+	double tokens;
+	double last_refill;
+};
+
+/*
+ * everything a context keeps between calls. The options are a copy, see
+ * sth_new().
+ */
+struct sth_context {
+	struct sth_options options;
+
+	xmlrpc_client *client;
+	xmlrpc_server_info *server_info;
+
+	int hash_cache_fd;
+	struct hash_cache_header *hash_cache;
+
+	char *session_token;
+	time_t session_last_used;
+	char *session_path;
+
+	struct rate_bucket rate_bucket;
+	unsigned short rand_state[3]; // of the jitter of the backoff
+
+	// calls put on the wire by rpc_start() which haven't completed yet
+	int rpc_inflight;
+	struct rpc_call *rpc_retries;
+	int rpc_stream_count;  // of those, the streamed ones in curl_multi
+
+	/*
+	 * the transfers of the streamed calls share the connections and DNS
+	 * lookups of the multi handle, so that a call reuses the connection of an
+	 * earlier one, or is multiplexed onto it with HTTP/2. The TLS sessions are
+	 * shared through curl_share, older versions of curl keep them per handle.
+	 * Both are only used by the thread in rpc_run(), so no locks are needed.
+	 */
+	CURLM *curl_multi;
+	CURLSH *curl_share;
+
+	char *search_cache_dir;
+	char *index_dir;
+	struct index_header *index_map;
+	size_t index_map_size;
+	char *blob_dir;
+	struct seen *seen;
+
+	struct stats stats;
+};
+
+static double stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stats_record(struct sth_context *ctx, enum stats_phase phase, double seconds) {
+	struct stats_histogram *h = &ctx->stats.phases[phase];
+	size_t b = 0;
+
+	while (b < STATS_BUCKETS && seconds > stats_buckets[b])
+		b++;
+	h->buckets[b]++;
+	h->count++;
+	h->sum += seconds;
+	if (seconds > h->max)
+		h->max = seconds;
+}
+
+/*
+ * adds the size of a response to the phase. Serializing it again is
+ * the only way to get at it, so this is only done with --stats.
+ */
+static void stats_record_response(struct sth_context *ctx, enum stats_phase phase, xmlrpc_value *result) {
+	_cleanup_env_ xmlrpc_env env;
+
+	if (!ctx->options.stats || !result)
+		return;
+
+	xmlrpc_env_init(&env);
+	xmlrpc_mem_block *xml = xmlrpc_mem_block_new(&env, 0);
+	if (env.fault_occurred)
+		return;
+
+	xmlrpc_serialize_value(&env, xml, result);
+	if (!env.fault_occurred)
+		ctx->stats.phases[phase].response_bytes += xmlrpc_mem_block_size(xml);
+	xmlrpc_mem_block_free(xml);
+}
+
+static void stats_free(struct sth_context *ctx) {
+	for (int i = 0; i < ctx->stats.file_count; i++)
+		free(ctx->stats.files[i].filepath);
+	free(ctx->stats.files);
+	ctx->stats.files = NULL;
+	ctx->stats.file_count = 0;
+	ctx->stats.file_capacity = 0;
+}
+
+static void stats_write_json_string(FILE *f, const char *s) {
+	putc('"', f);
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			putc(c, f);
+	}
+	putc('"', f);
+}
+
+static void stats_write_json(struct sth_context *ctx, FILE *f) {
+	fprintf(f, "{\n  \"version\": \"%s\",\n", VERSION);
+	fprintf(f, "  \"seconds\": %.6f,\n", stats_now() - ctx->stats.started);
+	fprintf(f, "  \"files\": %d,\n", ctx->stats.file_count);
+	fprintf(f, "  \"failed\": %" PRIu64 ",\n", ctx->stats.failed);
+	fprintf(f, "  \"bytes_read\": %" PRIu64 ",\n", ctx->stats.bytes_read);
+	fprintf(f, "  \"bytes_written\": %" PRIu64 ",\n", ctx->stats.bytes_written);
+	fprintf(f, "  \"hash_cache_hits\": %" PRIu64 ",\n", ctx->stats.hash_cache_hits);
+	fprintf(f, "  \"search_cache_hits\": %" PRIu64 ",\n", ctx->stats.search_cache_hits);
+	fprintf(f, "  \"index_hits\": %" PRIu64 ",\n", ctx->stats.index_hits);
+	fprintf(f, "  \"blob_hits\": %" PRIu64 ",\n", ctx->stats.blob_hits);
+	fprintf(f, "  \"duplicates\": %" PRIu64 ",\n", ctx->stats.duplicates);
+	fprintf(f, "  \"retries\": %" PRIu64 ",\n", ctx->stats.retries);
+	fprintf(f, "  \"throttled\": %" PRIu64 ",\n", ctx->stats.throttled);
+	fprintf(f, "  \"connections\": %" PRIu64 ",\n", ctx->stats.connections);
+	fprintf(f, "  \"connections_reused\": %" PRIu64 ",\n", ctx->stats.connections_reused);
+
+	fputs("  \"phases\": {\n", f);
+	for (int p = 0; p < STATS_PHASES; p++) {
+		const struct stats_histogram *h = &ctx->stats.phases[p];
+		uint64_t cumulative = 0;
+
+		fprintf(f, "    \"%s\": {\"count\": %" PRIu64 ", \"seconds\": %.6f, \"max_seconds\": %.6f, "
+		        "\"response_bytes\": %" PRIu64 ", \"histogram\": [",
+		        stats_phase_names[p], h->count, h->sum, h->max, h->response_bytes);
+		for (size_t b = 0; b <= STATS_BUCKETS; b++) {
+			cumulative += h->buckets[b];
+			if (b < STATS_BUCKETS)
+				fprintf(f, "{\"le\": %g, \"count\": %" PRIu64 "}, ", stats_buckets[b], cumulative);
+			else
+				fprintf(f, "{\"le\": \"+Inf\", \"count\": %" PRIu64 "}", cumulative);
+		}
+		fprintf(f, "]}%s\n", p + 1 < STATS_PHASES ? "," : "");
+	}
+	fputs("  },\n", f);
+
+	fputs("  \"per_file\": [", f);
+	for (int i = 0; i < ctx->stats.file_count; i++) {
+		const struct stats_file *file = &ctx->stats.files[i];
+
+		fputs(i ? ",\n    {\"path\": " : "\n    {\"path\": ", f);
+		stats_write_json_string(f, file->filepath);
+		fprintf(f, ", \"result\": %d", file->r);
+		for (int p = 0; p < STATS_PHASES; p++) {
+			if (p != STATS_LOGIN)
+				fprintf(f, ", \"%s_seconds\": %.6f", stats_phase_names[p], file->seconds[p]);
+		}
+		fprintf(f, ", \"bytes_read\": %" PRIu64 ", \"bytes_written\": %" PRIu64 "}",
+		        file->bytes_read, file->bytes_written);
+	}
+	fputs(ctx->stats.file_count ? "\n  ]\n}\n" : "]\n}\n", f);
+}
+
+/*
+ * the Prometheus textfile collector format. Per-file numbers are left out,
+ * a label per file would create a new time series for every video.
+ */
+static void stats_write_prometheus(struct sth_context *ctx, FILE *f) {
+	fputs("# HELP subberthehut_phase_duration_seconds Time spent per operation.\n"
+	      "# TYPE subberthehut_phase_duration_seconds histogram\n", f);
+	for (int p = 0; p < STATS_PHASES; p++) {
+		const struct stats_histogram *h = &ctx->stats.phases[p];
+		const char *name = stats_phase_names[p];
+		uint64_t cumulative = 0;
+
+		for (size_t b = 0; b < STATS_BUCKETS; b++) {
+			cumulative += h->buckets[b];
+			fprintf(f, "subberthehut_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+			        name, stats_buckets[b], cumulative);
+		}
+		fprintf(f, "subberthehut_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+		        name, h->count);
+		fprintf(f, "subberthehut_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n", name, h->sum);
+		fprintf(f, "subberthehut_phase_duration_seconds_count{phase=\"%s\"} %" PRIu64 "\n", name, h->count);
+	}
+
+	fputs("# HELP subberthehut_response_bytes_total Size of the XML-RPC responses.\n"
+	      "# TYPE subberthehut_response_bytes_total counter\n", f);
+	for (int p = 0; p < STATS_PHASES; p++) {
+		if (ctx->stats.phases[p].response_bytes > 0)
+			fprintf(f, "subberthehut_response_bytes_total{phase=\"%s\"} %" PRIu64 "\n",
+			        stats_phase_names[p], ctx->stats.phases[p].response_bytes);
+	}
+
+	fprintf(f, "# HELP subberthehut_bytes_read_total Bytes read from videos to hash them.\n"
+	        "# TYPE subberthehut_bytes_read_total counter\n"
+	        "subberthehut_bytes_read_total %" PRIu64 "\n", ctx->stats.bytes_read);
+	fprintf(f, "# HELP subberthehut_bytes_written_total Bytes of subtitles written.\n"
+	        "# TYPE subberthehut_bytes_written_total counter\n"
+	        "subberthehut_bytes_written_total %" PRIu64 "\n", ctx->stats.bytes_written);
+	fprintf(f, "# HELP subberthehut_files_total Files processed.\n"
+	        "# TYPE subberthehut_files_total counter\n"
+	        "subberthehut_files_total %d\n", ctx->stats.file_count);
+	fprintf(f, "# HELP subberthehut_files_failed_total Files no subtitle was written for.\n"
+	        "# TYPE subberthehut_files_failed_total counter\n"
+	        "subberthehut_files_failed_total %" PRIu64 "\n", ctx->stats.failed);
+	fprintf(f, "# HELP subberthehut_cache_hits_total Lookups answered by a cache.\n"
+	        "# TYPE subberthehut_cache_hits_total counter\n"
+	        "subberthehut_cache_hits_total{cache=\"hash\"} %" PRIu64 "\n"
+	        "subberthehut_cache_hits_total{cache=\"search\"} %" PRIu64 "\n"
+	        "subberthehut_cache_hits_total{cache=\"index\"} %" PRIu64 "\n"
+	        "subberthehut_cache_hits_total{cache=\"blob\"} %" PRIu64 "\n",
+	        ctx->stats.hash_cache_hits, ctx->stats.search_cache_hits, ctx->stats.index_hits, ctx->stats.blob_hits);
+	fprintf(f, "# HELP subberthehut_duplicates_total Files sharing the search of an identical one.\n"
+	        "# TYPE subberthehut_duplicates_total counter\n"
+	        "subberthehut_duplicates_total %" PRIu64 "\n", ctx->stats.duplicates);
+	fprintf(f, "# HELP subberthehut_retries_total Requests sent again after a failure.\n"
+	        "# TYPE subberthehut_retries_total counter\n"
+	        "subberthehut_retries_total %" PRIu64 "\n", ctx->stats.retries);
+	fprintf(f, "# HELP subberthehut_throttled_total Requests the server refused because of the rate limit.\n"
+	        "# TYPE subberthehut_throttled_total counter\n"
+	        "subberthehut_throttled_total %" PRIu64 "\n", ctx->stats.throttled);
+	fprintf(f, "# HELP subberthehut_connections_total Connections used by streamed requests.\n"
+	        "# TYPE subberthehut_connections_total counter\n"
+	        "subberthehut_connections_total{reused=\"false\"} %" PRIu64 "\n"
+	        "subberthehut_connections_total{reused=\"true\"} %" PRIu64 "\n",
+	        ctx->stats.connections, ctx->stats.connections_reused);
+	fprintf(f, "# HELP subberthehut_run_seconds Duration of the run.\n"
+	        "# TYPE subberthehut_run_seconds gauge\n"
+	        "subberthehut_run_seconds %.6f\n", stats_now() - ctx->stats.started);
+	fprintf(f, "# HELP subberthehut_last_run_timestamp_seconds End of the run.\n"
+	        "# TYPE subberthehut_last_run_timestamp_seconds gauge\n"
+	        "subberthehut_last_run_timestamp_seconds %lld\n", (long long) time(NULL));
+}
+
+/*
+ * the stats are written atomically, so that a collector never reads a half
+ * written file.
+ */
+int sth_stats_write(struct sth_context *ctx, const char *path) {
+	_cleanup_free_ char *tmp_path = NULL;
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) == -1)
+		return log_oom();
+
+	int fd = mkstemp(tmp_path);
+	if (fd == -1) {
+		log_err("failed to write stats to %s: %m", path);
+		return errno;
+	}
+	fchmod(fd, 0644);
+
+	_cleanup_fclose_ FILE *f = fdopen(fd, "w");
+	if (!f) {
+		int r = errno;
+		close(fd);
+		unlink(tmp_path);
+		return r;
+	}
+
+	size_t len = strlen(path);
+	if (len >= 5 && strcmp(path + len - 5, ".prom") == 0)
+		stats_write_prometheus(ctx, f);
+	else
+		stats_write_json(ctx, f);
+
+	int r = fclose(f);
+	f = NULL;
+	if (r != 0 || rename(tmp_path, path) == -1) {
+		r = errno;
+		log_err("failed to write stats to %s: %s", path, strerror(r));
+		unlink(tmp_path);
+		return r;
+	}
+
+	return 0;
+}
+
+/*
+ * sums up buf as little-endian 64-bit words. A trailing partial word is
+ * ignored, just like the reference implementation does.
+ */
+static uint64_t hash_sum(const unsigned char *buf, size_t len) {
+	uint64_t lanes[4] = { 0, 0, 0, 0 };
+	size_t words = len / sizeof(uint64_t);
+	size_t i = 0;
+
+	// independent accumulators allow the compiler to vectorize this loop
+	for (; i + 4 <= words; i += 4) {
+		for (int l = 0; l < 4; l++) {
+			uint64_t word;
+			memcpy(&word, buf + (i + l) * sizeof(word), sizeof(word));
+			lanes[l] += le64toh(word);
+		}
+	}
+	for (; i < words; i++) {
+		uint64_t word;
+		memcpy(&word, buf + i * sizeof(word), sizeof(word));
+		lanes[0] += le64toh(word);
+	}
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+/*
+ * reads len bytes at offset, returns the number of bytes read or -1.
+ */
+static ssize_t pread_full(int fd, unsigned char *buf, size_t len, off_t offset) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = pread(fd, buf + done, len - done, offset + done);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1)
+			return -1;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+/*
+ * creates the 64-bit hash used for the search query: the filesize plus the
+ * sum of the first and the last 64 KiB (files smaller than that are
+ * summed up once, like the original implementation did).
+ * see also:
+ * http://trac.opensubtitles.org/projects/opensubtitles/wiki/HashSourceCodes
+ */
+static int get_hash_and_filesize(int fd, uint64_t *hash, uint64_t *filesize, struct stat *st) {
+	unsigned char buf[HASH_CHUNK];
+
+	if (fstat(fd, st) == -1)
+		return errno;
+
+	*filesize = st->st_size;
+	*hash = *filesize;
+
+	size_t len = *filesize < HASH_CHUNK ? *filesize : HASH_CHUNK;
+	off_t tail = *filesize - len;
+
+	// only two small windows are needed, don't let the kernel read ahead
+	posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+	ssize_t r = pread_full(fd, buf, len, 0);
+	if (r == -1)
+		return errno;
+	*hash += hash_sum(buf, r);
+
+	if (len == HASH_CHUNK) {
+		r = pread_full(fd, buf, len, tail);
+		if (r == -1)
+			return errno;
+		*hash += hash_sum(buf, r);
+	}
+
+	// nor keep the windows in the page cache
+	posix_fadvise(fd, 0, len, POSIX_FADV_DONTNEED);
+	posix_fadvise(fd, tail, len, POSIX_FADV_DONTNEED);
+
+	return 0;
+}
+
+/*
+ * creates path and all of its missing parents.
+ */
+static int mkdir_parents(const char *path, mode_t mode) {
+	_cleanup_free_ char *p = strdup(path);
+	if (!p)
+		return ENOMEM;
+
+	for (char *slash = strchr(p + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+		if (slash)
+			*slash = '\0';
+		if (mkdir(p, mode) == -1 && errno != EEXIST)
+			return errno;
+		if (!slash)
+			return 0;
+		*slash = '/';
+	}
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t r = write(fd, buf, len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1)
+			return errno;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+// a sink writing to the file descriptor data points to
+static int fd_sink_write(void *data, const void *buf, size_t len) {
+	return write_full(*(int *) data, buf, len);
+}
+
+/*
+ * returns the directory for subberthehut's caches, which is created if needed.
+ */
+static char *get_cache_dir() {
+	char *dir = NULL;
+	const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int r;
+
+	if (xdg_cache_home && xdg_cache_home[0] == '/')
+		r = asprintf(&dir, "%s/subberthehut", xdg_cache_home);
+	else if (home)
+		r = asprintf(&dir, "%s/.cache/subberthehut", home);
+	else
+		return NULL;
+
+	if (r == -1)
+		return NULL;
+
+	if (mkdir_parents(dir, 0755) != 0) {
+		free(dir);
+		return NULL;
+	}
+
+	return dir;
+}
+
+/*
+ * the hash cache maps a file's identity (device, inode, size and mtime)
+ * to its hash, so unchanged files don't have to be read again.
+ * The table is shared between processes via mmap, writers and readers
+ * are serialized with flock().
+ */
+struct hash_cache_entry {
+	uint64_t dev;
+	uint64_t ino;      // 0 for an empty slot
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+};
+
+struct hash_cache_header {
+	char magic[8];
+	uint64_t slots;
+	struct hash_cache_entry entries[];
+};
+
+#define HASH_CACHE_MAP_SIZE (sizeof(struct hash_cache_header) + HASH_CACHE_SLOTS * sizeof(struct hash_cache_entry))
+
+static int hash_cache_open(struct sth_context *ctx) {
+	_cleanup_free_ char *dir = get_cache_dir();
+	_cleanup_free_ char *path = NULL;
+	struct stat st;
+
+	if (!dir || asprintf(&path, "%s/hashes", dir) == -1)
+		return ENOMEM;
+
+	ctx->hash_cache_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (ctx->hash_cache_fd == -1)
+		return errno;
+
+	// initialize the table if this is a new (or foreign) file
+	flock(ctx->hash_cache_fd, LOCK_EX);
+	if (fstat(ctx->hash_cache_fd, &st) == 0 && st.st_size != HASH_CACHE_MAP_SIZE) {
+		if (ftruncate(ctx->hash_cache_fd, 0) == -1 || ftruncate(ctx->hash_cache_fd, HASH_CACHE_MAP_SIZE) == -1) {
+			int r = errno;
+			flock(ctx->hash_cache_fd, LOCK_UN);
+			return r;
+		}
+	}
+
+	ctx->hash_cache = mmap(NULL, HASH_CACHE_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->hash_cache_fd, 0);
+	if (ctx->hash_cache == MAP_FAILED) {
+		int r = errno;
+		ctx->hash_cache = NULL;
+		flock(ctx->hash_cache_fd, LOCK_UN);
+		return r;
+	}
+
+	if (memcmp(ctx->hash_cache->magic, HASH_CACHE_MAGIC, sizeof(ctx->hash_cache->magic)) != 0 ||
+	    ctx->hash_cache->slots != HASH_CACHE_SLOTS) {
+		memset(ctx->hash_cache, 0, HASH_CACHE_MAP_SIZE);
+		memcpy(ctx->hash_cache->magic, HASH_CACHE_MAGIC, sizeof(ctx->hash_cache->magic));
+		ctx->hash_cache->slots = HASH_CACHE_SLOTS;
+	}
+	flock(ctx->hash_cache_fd, LOCK_UN);
+
+	return 0;
+}
+
+static void hash_cache_close(struct sth_context *ctx) {
+	if (ctx->hash_cache)
+		munmap(ctx->hash_cache, HASH_CACHE_MAP_SIZE);
+	if (ctx->hash_cache_fd >= 0)
+		close(ctx->hash_cache_fd);
+	ctx->hash_cache = NULL;
+	ctx->hash_cache_fd = -1;
+}
+
+static uint64_t hash_cache_slot(const struct stat *st) {
+	// mix device and inode (splitmix64 finalizer)
+	uint64_t x = (uint64_t) st->st_ino ^ ((uint64_t) st->st_dev << 32 | (uint64_t) st->st_dev >> 32);
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x & (HASH_CACHE_SLOTS - 1);
+}
+
+static bool hash_cache_entry_matches(const struct hash_cache_entry *e, const struct stat *st) {
+	return e->dev == (uint64_t) st->st_dev && e->ino == (uint64_t) st->st_ino;
+}
+
+/*
+ * looks up the hash of the file described by st.
+ * the caller must hold a shared (or exclusive) lock on hash_cache_fd.
+ */
+static bool hash_cache_lookup(struct sth_context *ctx, const struct stat *st, uint64_t *hash) {
+	uint64_t slot = hash_cache_slot(st);
+
+	for (int i = 0; i < HASH_CACHE_PROBES; i++) {
+		const struct hash_cache_entry *e = &ctx->hash_cache->entries[(slot + i) & (HASH_CACHE_SLOTS - 1)];
+		if (e->ino == 0)
+			return false;
+		if (!hash_cache_entry_matches(e, st))
+			continue;
+
+		if (e->size != (uint64_t) st->st_size ||
+		    e->mtime_sec != st->st_mtim.tv_sec ||
+		    e->mtime_nsec != st->st_mtim.tv_nsec)
+			return false;
+
+		*hash = e->hash;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * stores the hash of the file described by st.
+ * the caller must hold an exclusive lock on hash_cache_fd.
+ */
+static void hash_cache_store(struct sth_context *ctx, const struct stat *st, uint64_t hash) {
+	uint64_t slot = hash_cache_slot(st);
+	struct hash_cache_entry *e = NULL;
+
+	for (int i = 0; i < HASH_CACHE_PROBES; i++) {
+		e = &ctx->hash_cache->entries[(slot + i) & (HASH_CACHE_SLOTS - 1)];
+		if (e->ino == 0 || hash_cache_entry_matches(e, st))
+			break;
+		e = NULL;
+	}
+
+	// all probed slots are taken, evict the first one
+	if (!e)
+		e = &ctx->hash_cache->entries[slot];
+
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime_sec = st->st_mtim.tv_sec;
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+	e->hash = hash;
+}
+
+/*
+ * convenience function the get a string value from a xmlrpc struct.
+ */
+static const char *struct_get_string(xmlrpc_env *env, xmlrpc_value *s, const char *key) {
+	_cleanup_xmlrpc_ xmlrpc_value *xmlval = NULL;
+	const char *str = NULL;
+
+	xmlrpc_struct_find_value(env, s, key, &xmlval);
+	if (!env->fault_occurred && !xmlval)
+		xmlrpc_faultf(env, "member '%s' is missing", key);
+	if (env->fault_occurred)
+		return NULL;
+
+	xmlrpc_read_string(env, xmlval, &str);
+
+	return str;
+}
+
+/*
+ * the session token is kept in $XDG_CACHE_HOME/subberthehut/session together
+ * with the time it was last used, so that following invocations can skip
+ * the login. Logging in is deferred until a method needs the token.
+ */
+
+static void session_drop(struct sth_context *ctx) {
+	free(ctx->session_token);
+	ctx->session_token = NULL;
+}
+
+static void session_open(struct sth_context *ctx) {
+	_cleanup_free_ char *dir = get_cache_dir();
+	if (!dir || asprintf(&ctx->session_path, "%s/session", dir) == -1) {
+		ctx->session_path = NULL;
+		return;
+	}
+
+	_cleanup_fclose_ FILE *f = fopen(ctx->session_path, "r");
+	if (!f)
+		return;
+
+	// a token is only valid for the server it was issued by
+	char token[128];
+	long long last_used;
+	char url[2048];
+	if (fscanf(f, "%127s %lld %2047s", token, &last_used, url) != 3 || strcmp(url, ctx->options.server_url))
+		return;
+
+	ctx->session_token = strdup(token);
+	ctx->session_last_used = last_used;
+}
+
+static void session_save(struct sth_context *ctx) {
+	_cleanup_free_ char *tmp_path = NULL;
+
+	if (!ctx->session_path || !ctx->session_token || asprintf(&tmp_path, "%s.XXXXXX", ctx->session_path) == -1)
+		return;
+
+	// mkstemp() creates the file with mode 0600
+	int fd = mkstemp(tmp_path);
+	if (fd == -1)
+		return;
+
+	_cleanup_fclose_ FILE *f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp_path);
+		return;
+	}
+
+	fprintf(f, "%s\n%lld\n%s\n", ctx->session_token, (long long) ctx->session_last_used, ctx->options.server_url);
+
+	int r = fclose(f);
+	f = NULL;
+	if (r != 0 || rename(tmp_path, ctx->session_path) == -1)
+		unlink(tmp_path);
+}
+
+static void session_close(struct sth_context *ctx) {
+	session_save(ctx);
+	session_drop(ctx);
+	free(ctx->session_path);
+	ctx->session_path = NULL;
+}
+
+static void rate_init(struct sth_context *ctx) {
+	ctx->rate_bucket.capacity = ctx->options.rate_limit;
+	ctx->rate_bucket.max_rate = (double) ctx->options.rate_limit / RATE_LIMIT_WINDOW;
+	ctx->rate_bucket.rate = ctx->rate_bucket.max_rate;
+	ctx->rate_bucket.tokens = ctx->rate_bucket.capacity;
+	ctx->rate_bucket.last_refill = stats_now();
+}
+
+static void rate_refill(struct sth_context *ctx) {
+	double now = stats_now();
+	ctx->rate_bucket.tokens += (now - ctx->rate_bucket.last_refill) * ctx->rate_bucket.rate;
+	if (ctx->rate_bucket.tokens > ctx->rate_bucket.capacity)
+		ctx->rate_bucket.tokens = ctx->rate_bucket.capacity;
+	ctx->rate_bucket.last_refill = now;
+}
+
+static void rate_throttled(struct sth_context *ctx) {
+	ctx->rate_bucket.rate /= 2;
+	if (ctx->rate_bucket.rate < RATE_MIN)
+		ctx->rate_bucket.rate = RATE_MIN;
+	// the burst is what got us throttled
+	ctx->rate_bucket.tokens = 0;
+	ctx->stats.throttled++;
+}
+
+static void rate_succeeded(struct sth_context *ctx) {
+	ctx->rate_bucket.rate += RATE_INCREASE;
+	if (ctx->rate_bucket.rate > ctx->rate_bucket.max_rate)
+		ctx->rate_bucket.rate = ctx->rate_bucket.max_rate;
+}
+
+/*
+ * returns the "status" member of a response, or NULL if there is none.
+ */
+static const char *result_get_status(xmlrpc_value *result) {
+	_cleanup_env_ xmlrpc_env env;
+	_cleanup_xmlrpc_ xmlrpc_value *status_xmlval = NULL;
+	const char *status = NULL;
+
+	xmlrpc_env_init(&env);
+	xmlrpc_struct_find_value(&env, result, "status", &status_xmlval);
+	if (status_xmlval)
+		xmlrpc_read_string(&env, status_xmlval, &status);
+
+	return status;
+}
+
+/*
+ * calls to methods which take the session token as their first parameter
+ * are made asynchronously: rpc_start() puts a call on the wire, waiting
+ * while max_inflight calls are already in flight, and rpc_finish() waits
+ * for all of them. done() is invoked exactly once per call, r is set on
+ * failure. It gets the result on success or NULL on failure; the result is
+ * only valid during done().
+ * If the server rejects the token, the call is restarted with a new one.
+ * Calls that were throttled or failed for a transient reason are restarted
+ * after a backoff, up to RPC_MAX_ATTEMPTS times.
+ *
+ * The response to a call with a scan() callback isn't parsed into an
+ * xmlrpc_value (done() always gets NULL then). Instead, it is streamed with
+ * a libcurl multi handle which is driven by rpc_run() on the calling thread,
+ * and scan() is called for every scalar struct member as it arrives, see
+ * struct xml_scan.
+ */
+enum scan_event {
+	SCAN_BEGIN,            // a new attempt, forget what was scanned before
+	SCAN_MEMBER,
+	SCAN_STRUCT_END,
+};
+
+struct rpc_call {
+	const char *method;
+	xmlrpc_value *params; // the parameters after the token, owned by the caller
+	void (*done)(struct rpc_call *call, xmlrpc_value *result);
+	void (*scan)(struct rpc_call *call, enum scan_event event, int depth,
+	             const char *parent, const char *name, const char *value);
+	int r;
+	struct sth_context *ctx; // set by rpc_start()
+
+	enum stats_phase phase;
+	double started;
+	double seconds;        // time on the wire, known in done()
+
+	bool retried;          // with a new token
+	int attempts;          // after throttled or transient failures
+	double retry_at;
+	struct rpc_call *next_retry;
+};
+
+enum rpc_failure {
+	RPC_PERMANENT,
+	RPC_TRANSIENT,
+	RPC_THROTTLED,
+};
+
+/*
+ * tells whether a failed call is worth another try, from the fault or the
+ * status of the response.
+ */
+static enum rpc_failure rpc_classify(const xmlrpc_env *fault, const char *status) {
+	if (fault->fault_occurred) {
+		if (fault->fault_code != XMLRPC_NETWORK_ERROR && fault->fault_code != XMLRPC_TIMEOUT_ERROR)
+			return RPC_PERMANENT;
+
+		// the curl transport reports HTTP errors as "HTTP response code is 503, not 200"
+		if (strstr(fault->fault_string, "code is 429") || strstr(fault->fault_string, "code is 503"))
+			return RPC_THROTTLED;
+		return RPC_TRANSIENT;
+	}
+
+	if (strncmp(status, "429", 3) == 0 || strncmp(status, "503", 3) == 0)
+		return RPC_THROTTLED;
+	// e.g. "506 Server under maintenance", but not "407 Download limit reached"
+	if (status[0] == '5')
+		return RPC_TRANSIENT;
+	return RPC_PERMANENT;
+}
+
+static void rpc_retry_later(struct rpc_call *call, double delay) {
+	struct sth_context *ctx = call->ctx;
+
+	call->retry_at = stats_now() + delay;
+	call->next_retry = ctx->rpc_retries;
+	ctx->rpc_retries = call;
+}
+
+/*
+ * exponential backoff with "equal jitter": at least half of the backoff is
+ * waited, the rest is random so that the retries of a batch spread out.
+ */
+static double rpc_backoff(struct sth_context *ctx, int attempt) {
+	double backoff = RPC_BACKOFF_BASE * (1 << (attempt - 1));
+	if (backoff > RPC_BACKOFF_MAX)
+		backoff = RPC_BACKOFF_MAX;
+	return backoff / 2 + erand48(ctx->rand_state) * backoff / 2;
+}
+
+/*
+ * handles the response to a call put on the wire by rpc_start(),
+ * fault is set if there is none.
+ */
+static void rpc_handle_response(struct rpc_call *call, xmlrpc_env *fault, const char *status,
+                                xmlrpc_value *result) {
+	struct sth_context *ctx = call->ctx;
+
+	ctx->rpc_inflight--;
+
+	call->seconds = stats_now() - call->started;
+	stats_record(ctx, call->phase, call->seconds);
+
+	if (status && strncmp(status, "401", 3) == 0 && !call->retried) {
+		// token expired or was revoked, restart the call from rpc_finish()
+		session_drop(ctx);
+		call->retried = true;
+		rpc_retry_later(call, 0);
+		return;
+	}
+
+	if (fault->fault_occurred || (status && strcmp(status, "200 OK"))) {
+		const char *reason = fault->fault_occurred ? fault->fault_string : status;
+		enum rpc_failure failure = rpc_classify(fault, status);
+
+		if (failure == RPC_THROTTLED)
+			rate_throttled(ctx);
+
+		if (failure != RPC_PERMANENT && ++call->attempts < RPC_MAX_ATTEMPTS) {
+			double delay = rpc_backoff(ctx, call->attempts);
+			log_err("warning: %s failed: %s, retrying in %.1f seconds.", call->method, reason, delay);
+			ctx->stats.retries++;
+			rpc_retry_later(call, delay);
+			return;
+		}
+
+		if (fault->fault_occurred)
+			log_err("%s failed: %s (%d)", call->method, fault->fault_string, fault->fault_code);
+		else
+			log_err("%s failed: %s", call->method, status);
+		call->r = fault->fault_occurred ? fault->fault_code : 1;
+		call->done(call, NULL);
+		return;
+	}
+
+	rate_succeeded(ctx);
+	ctx->session_last_used = time(NULL);
+	call->done(call, result);
+}
+
+/*
+ * an incremental scanner for XML-RPC responses, which can be fed with chunks
+ * of any size. member() is called for every scalar member of a struct, with
+ * the depth of the struct (1 is the struct returned by the method) and the
+ * name of the member the struct is in (NULL at depth 1). struct_end() is
+ * called at the end of every struct. Only the token being scanned is
+ * buffered, and values are passed as they are, no matter their type.
+ */
+#define XML_SCAN_MAX_DEPTH 16
+
+struct xml_scan {
+	void (*member)(void *data, int depth, const char *parent, const char *name, const char *value);
+	void (*struct_end)(void *data, int depth, const char *parent);
+	void *data;
+
+	char *buf;           // input which wasn't scanned yet
+	size_t len;
+	size_t capacity;
+
+	char *text;          // of the <name> or scalar <value> being scanned
+	size_t text_len;
+	size_t text_capacity;
+	bool capture;        // text is appended to text
+	bool scalar;         // the open <value> holds no struct or array
+
+	int depth;
+	char *names[XML_SCAN_MAX_DEPTH + 1]; // name of the open member per depth
+};
+
+static int xml_scan_append(char **buf, size_t *len, size_t *capacity, const char *s, size_t n) {
+	if (*len + n + 1 > *capacity) {
+		size_t c = *capacity ? *capacity : 256;
+		while (c < *len + n + 1)
+			c *= 2;
+		char *b = realloc(*buf, c);
+		if (!b)
+			return ENOMEM;
+		*buf = b;
+		*capacity = c;
+	}
+	memcpy(*buf + *len, s, n);
+	*len += n;
+	(*buf)[*len] = '\0';
+	return 0;
+}
+
+static void xml_scan_clear_text(struct xml_scan *x) {
+	x->text_len = 0;
+	if (x->text)
+		x->text[0] = '\0';
+}
+
+/*
+ * appends s to the text, replacing the entities.
+ */
+static int xml_scan_text(struct xml_scan *x, const char *s, size_t n) {
+	const char *end = s + n;
+
+	while (s < end) {
+		const char *amp = memchr(s, '&', end - s);
+		if (xml_scan_append(&x->text, &x->text_len, &x->text_capacity, s, (amp ? amp : end) - s) != 0)
+			return ENOMEM;
+		if (!amp)
+			break;
+
+		const char *semi = memchr(amp, ';', end - amp);
+		if (!semi)
+			semi = amp;
+		const char *e = amp + 1;
+		size_t e_len = semi - e;
+		unsigned char u[4];
+		size_t u_len = 0;
+		unsigned long cp = 0;
+
+		if (e_len == 2 && strncmp(e, "lt", 2) == 0)
+			cp = '<';
+		else if (e_len == 2 && strncmp(e, "gt", 2) == 0)
+			cp = '>';
+		else if (e_len == 3 && strncmp(e, "amp", 3) == 0)
+			cp = '&';
+		else if (e_len == 4 && strncmp(e, "quot", 4) == 0)
+			cp = '"';
+		else if (e_len == 4 && strncmp(e, "apos", 4) == 0)
+			cp = '\'';
+		else if (e_len > 1 && e[0] == '#')
+			cp = e[1] == 'x' ? strtoul(e + 2, NULL, 16) : strtoul(e + 1, NULL, 10);
+
+		// as UTF-8
+		if (cp == 0 || cp >= 0x110000) {
+			u_len = 0;
+		} else if (cp < 0x80) {
+			u[u_len++] = cp;
+		} else if (cp < 0x800) {
+			u[u_len++] = 0xc0 | cp >> 6;
+			u[u_len++] = 0x80 | (cp & 0x3f);
+		} else if (cp < 0x10000) {
+			u[u_len++] = 0xe0 | cp >> 12;
+			u[u_len++] = 0x80 | (cp >> 6 & 0x3f);
+			u[u_len++] = 0x80 | (cp & 0x3f);
+		} else {
+			u[u_len++] = 0xf0 | cp >> 18;
+			u[u_len++] = 0x80 | (cp >> 12 & 0x3f);
+			u[u_len++] = 0x80 | (cp >> 6 & 0x3f);
+			u[u_len++] = 0x80 | (cp & 0x3f);
+		}
+
+		// unknown entities are kept as they are
+		int r = u_len ? xml_scan_append(&x->text, &x->text_len, &x->text_capacity, (char *) u, u_len)
+		              : xml_scan_append(&x->text, &x->text_len, &x->text_capacity, amp, semi + 1 - amp);
+		if (r != 0)
+			return r;
+		s = semi + 1;
+	}
+
+	return 0;
+}
+
+static bool xml_tag_is(const char *tag, size_t len, const char *name) {
+	return strlen(name) == len && strncmp(tag, name, len) == 0;
+}
+
+static void xml_scan_emit(struct xml_scan *x) {
+	if (x->depth >= 1 && x->depth <= XML_SCAN_MAX_DEPTH && x->names[x->depth])
+		x->member(x->data, x->depth, x->depth > 1 ? x->names[x->depth - 1] : NULL,
+		          x->names[x->depth], x->text ? x->text : "");
+}
+
+/*
+ * handles what is between '<' and '>'.
+ */
+static int xml_scan_tag(struct xml_scan *x, const char *tag, size_t len) {
+	bool closing = len > 0 && tag[0] == '/';
+	bool empty = len > 0 && tag[len - 1] == '/';
+	if (closing) {
+		tag++;
+		len--;
+	}
+	if (empty)
+		len--;
+
+	size_t name_len = 0;
+	while (name_len < len && !isspace((unsigned char) tag[name_len]))
+		name_len++;
+
+	if (xml_tag_is(tag, name_len, "value")) {
+		if (!closing) {
+			x->scalar = true;
+			x->capture = true;
+			xml_scan_clear_text(x);
+		}
+		if (closing || empty) {
+			if (x->scalar)
+				xml_scan_emit(x);
+			x->scalar = false;
+			x->capture = false;
+		}
+	} else if (xml_tag_is(tag, name_len, "name")) {
+		if (!closing) {
+			x->capture = true;
+			xml_scan_clear_text(x);
+		}
+		if ((closing || empty) && x->depth >= 1 && x->depth <= XML_SCAN_MAX_DEPTH) {
+			free(x->names[x->depth]);
+			x->names[x->depth] = strdup(x->text ? x->text : "");
+			if (!x->names[x->depth])
+				return ENOMEM;
+			x->capture = false;
+		}
+	} else if (xml_tag_is(tag, name_len, "struct")) {
+		x->scalar = false;
+		x->capture = false;
+		if (!closing)
+			x->depth++;
+		if (closing || empty) {
+			if (x->depth >= 1 && x->depth <= XML_SCAN_MAX_DEPTH) {
+				x->struct_end(x->data, x->depth, x->depth > 1 ? x->names[x->depth - 1] : NULL);
+				free(x->names[x->depth]);
+				x->names[x->depth] = NULL;
+			}
+			if (x->depth > 0)
+				x->depth--;
+		}
+	} else if (xml_tag_is(tag, name_len, "array")) {
+		x->scalar = false;
+		x->capture = false;
+	} else if (xml_tag_is(tag, name_len, "member")) {
+		if (closing && x->depth >= 1 && x->depth <= XML_SCAN_MAX_DEPTH) {
+			free(x->names[x->depth]);
+			x->names[x->depth] = NULL;
+		}
+	} else if (x->scalar) {
+		// the type of a scalar, e.g. <string>, only its content counts
+		if (!closing)
+			xml_scan_clear_text(x);
+		if (closing || empty)
+			x->capture = false;
+	}
+
+	return 0;
+}
+
+static int xml_scan_feed(struct xml_scan *x, const char *data, size_t len) {
+	if (xml_scan_append(&x->buf, &x->len, &x->capacity, data, len) != 0)
+		return ENOMEM;
+
+	size_t pos = 0;
+	int r = 0;
+	while (pos < x->len && r == 0) {
+		char *p = x->buf + pos;
+		size_t left = x->len - pos;
+
+		if (*p != '<') {
+			char *lt = memchr(p, '<', left);
+			if (!lt)
+				break; // the text may go on in the next chunk
+			if (x->capture)
+				r = xml_scan_text(x, p, lt - p);
+			pos = lt - x->buf;
+			continue;
+		}
+
+		if (left >= 2 && p[1] == '!') {
+			// comments, CDATA sections and declarations
+			if (left < 9)
+				break; // can't tell which one it is yet
+			bool cdata = strncmp(p, "<![CDATA[", 9) == 0;
+			const char *terminator = cdata ? "]]>" : strncmp(p, "<!--", 4) == 0 ? "-->" : ">";
+			char *end = memmem(p, left, terminator, strlen(terminator));
+			if (!end)
+				break;
+			if (cdata && x->capture)
+				r = xml_scan_append(&x->text, &x->text_len, &x->text_capacity, p + 9, end - p - 9);
+			pos = end + strlen(terminator) - x->buf;
+			continue;
+		}
+
+		char *gt = memchr(p, '>', left);
+		if (!gt)
+			break;
+		if (p[1] != '?')
+			r = xml_scan_tag(x, p + 1, gt - p - 1);
+		pos = gt + 1 - x->buf;
+	}
+
+	memmove(x->buf, x->buf + pos, x->len - pos);
+	x->len -= pos;
+
+	return r;
+}
+
+static void xml_scan_free(struct xml_scan *x) {
+	free(x->buf);
+	free(x->text);
+	for (int i = 0; i <= XML_SCAN_MAX_DEPTH; i++)
+		free(x->names[i]);
+	memset(x, 0, sizeof(*x));
+}
+
+/*
+ * a call whose response is scanned while it arrives, see struct rpc_call.
+ */
+struct rpc_stream {
+	struct rpc_call *call;
+	xmlrpc_mem_block *request;
+	struct xml_scan scan;
+	CURL *curl;
+	struct curl_slist *headers;
+
+	CURLcode curl_r;
+	char curl_error[CURL_ERROR_SIZE];
+	long http_code;
+	long connects;         // new connections, 0 if one was reused
+	uint64_t bytes;
+	bool failed;           // out of memory while scanning
+	char *status;
+	bool fault;
+	int fault_code;
+	char *fault_string;
+};
+
+static int transport_init(struct sth_context *ctx) {
+	ctx->curl_multi = curl_multi_init();
+	ctx->curl_share = curl_share_init();
+	if (!ctx->curl_multi || !ctx->curl_share)
+		return ENOMEM;
+
+	if (ctx->options.http2)
+		curl_multi_setopt(ctx->curl_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_share_setopt(ctx->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	return 0;
+}
+
+static void transport_free(struct sth_context *ctx) {
+	// the easy handles are gone by now, rpc_finish() waits for them
+	if (ctx->curl_multi)
+		curl_multi_cleanup(ctx->curl_multi);
+	ctx->curl_multi = NULL;
+	if (ctx->curl_share)
+		curl_share_cleanup(ctx->curl_share);
+	ctx->curl_share = NULL;
+}
+
+static void rpc_stream_member(void *data, int depth, const char *parent, const char *name, const char *value) {
+	struct rpc_stream *stream = data;
+
+	if (depth == 1 && strcmp(name, "status") == 0) {
+		free(stream->status);
+		stream->status = strdup(value);
+		if (!stream->status)
+			stream->failed = true;
+	} else if (depth == 1 && strcmp(name, "faultCode") == 0) {
+		stream->fault = true;
+		stream->fault_code = strtol(value, NULL, 10);
+	} else if (depth == 1 && strcmp(name, "faultString") == 0) {
+		free(stream->fault_string);
+		stream->fault_string = strdup(value);
+	}
+
+	stream->call->scan(stream->call, SCAN_MEMBER, depth, parent, name, value);
+}
+
+static void rpc_stream_struct_end(void *data, int depth, const char *parent) {
+	struct rpc_stream *stream = data;
+	stream->call->scan(stream->call, SCAN_STRUCT_END, depth, parent, NULL, NULL);
+}
+
+static size_t rpc_stream_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+	struct rpc_stream *stream = userdata;
+	long http_code = 0;
+
+	stream->bytes += size * nmemb;
+
+	// an error page isn't XML-RPC, the status code is reported instead
+	curl_easy_getinfo(stream->curl, CURLINFO_RESPONSE_CODE, &http_code);
+	if (http_code != 200)
+		return size * nmemb;
+
+	if (xml_scan_feed(&stream->scan, ptr, size * nmemb) != 0) {
+		stream->failed = true;
+		return 0; // aborts the transfer
+	}
+	return size * nmemb;
+}
+
+static void rpc_stream_free(struct rpc_stream *stream) {
+	if (stream->curl) {
+		curl_multi_remove_handle(stream->call->ctx->curl_multi, stream->curl);
+		curl_easy_cleanup(stream->curl);
+	}
+	curl_slist_free_all(stream->headers);
+	if (stream->request)
+		xmlrpc_mem_block_free(stream->request);
+	xml_scan_free(&stream->scan);
+	free(stream->status);
+	free(stream->fault_string);
+	free(stream);
+}
+
+static void rpc_stream_start(xmlrpc_env *env, struct rpc_call *call, xmlrpc_value *params) {
+	struct sth_context *ctx = call->ctx;
+	struct rpc_stream *stream = calloc(1, sizeof(struct rpc_stream));
+	if (!stream) {
+		xmlrpc_env_set_fault(env, XMLRPC_INTERNAL_ERROR, "Out of Memory.");
+		return;
+	}
+
+	stream->call = call;
+	stream->scan.member = rpc_stream_member;
+	stream->scan.struct_end = rpc_stream_struct_end;
+	stream->scan.data = stream;
+
+	stream->request = xmlrpc_mem_block_new(env, 0);
+	if (!env->fault_occurred)
+		xmlrpc_serialize_call(env, stream->request, call->method, params);
+
+	if (!env->fault_occurred) {
+		stream->curl = curl_easy_init();
+		stream->headers = curl_slist_append(NULL, "Content-Type: text/xml");
+		if (!stream->curl || !stream->headers)
+			xmlrpc_env_set_fault(env, XMLRPC_INTERNAL_ERROR, "Out of Memory.");
+	}
+
+	if (!env->fault_occurred) {
+		curl_easy_setopt(stream->curl, CURLOPT_URL, ctx->options.server_url);
+		curl_easy_setopt(stream->curl, CURLOPT_POSTFIELDS, xmlrpc_mem_block_contents(stream->request));
+		curl_easy_setopt(stream->curl, CURLOPT_POSTFIELDSIZE_LARGE,
+		                 (curl_off_t) xmlrpc_mem_block_size(stream->request));
+		curl_easy_setopt(stream->curl, CURLOPT_HTTPHEADER, stream->headers);
+		curl_easy_setopt(stream->curl, CURLOPT_USERAGENT, "subberthehut/" VERSION);
+		curl_easy_setopt(stream->curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(stream->curl, CURLOPT_WRITEFUNCTION, rpc_stream_write);
+		curl_easy_setopt(stream->curl, CURLOPT_WRITEDATA, stream);
+		curl_easy_setopt(stream->curl, CURLOPT_ERRORBUFFER, stream->curl_error);
+		curl_easy_setopt(stream->curl, CURLOPT_PRIVATE, stream);
+
+		// transport tuning, see also the xmlrpc-c client created in sth_new()
+		curl_easy_setopt(stream->curl, CURLOPT_SHARE, ctx->curl_share);
+		curl_easy_setopt(stream->curl, CURLOPT_TCP_NODELAY, 1L);
+		curl_easy_setopt(stream->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+		curl_easy_setopt(stream->curl, CURLOPT_ACCEPT_ENCODING, ""); // all curl can decode
+		curl_easy_setopt(stream->curl, CURLOPT_CONNECTTIMEOUT, (long) ctx->options.connect_timeout);
+		curl_easy_setopt(stream->curl, CURLOPT_TIMEOUT, (long) ctx->options.timeout);
+		if (ctx->options.http2) {
+			curl_easy_setopt(stream->curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+			// wait for a connection which can multiplex instead of opening another
+			curl_easy_setopt(stream->curl, CURLOPT_PIPEWAIT, 1L);
+		}
+
+		call->scan(call, SCAN_BEGIN, 0, NULL, NULL, NULL);
+		CURLMcode mr = curl_multi_add_handle(ctx->curl_multi, stream->curl);
+		if (mr != CURLM_OK)
+			xmlrpc_env_set_fault_formatted(env, XMLRPC_INTERNAL_ERROR, "failed to start the transfer: %s",
+			                               curl_multi_strerror(mr));
+	}
+
+	if (env->fault_occurred) {
+		rpc_stream_free(stream);
+		return;
+	}
+
+	ctx->rpc_stream_count++;
+}
+
+static void rpc_stream_complete(struct rpc_stream *stream) {
+	struct sth_context *ctx = stream->call->ctx;
+	_cleanup_env_ xmlrpc_env fault;
+
+	xmlrpc_env_init(&fault);
+	curl_easy_getinfo(stream->curl, CURLINFO_RESPONSE_CODE, &stream->http_code);
+	curl_easy_getinfo(stream->curl, CURLINFO_NUM_CONNECTS, &stream->connects);
+
+	// the faults are those the xmlrpc-c transport would report
+	if (stream->failed)
+		xmlrpc_env_set_fault(&fault, XMLRPC_INTERNAL_ERROR, "Out of Memory.");
+	else if (stream->curl_r == CURLE_OPERATION_TIMEDOUT)
+		xmlrpc_env_set_fault(&fault, XMLRPC_TIMEOUT_ERROR, stream->curl_error);
+	else if (stream->curl_r != CURLE_OK)
+		xmlrpc_env_set_fault(&fault, XMLRPC_NETWORK_ERROR,
+		                     *stream->curl_error ? stream->curl_error : curl_easy_strerror(stream->curl_r));
+	else if (stream->http_code != 200)
+		xmlrpc_env_set_fault_formatted(&fault, XMLRPC_NETWORK_ERROR,
+		                               "HTTP response code is %ld, not 200", stream->http_code);
+	else if (stream->fault)
+		xmlrpc_env_set_fault(&fault, stream->fault_code,
+		                     stream->fault_string ? stream->fault_string : "unknown fault");
+
+	ctx->stats.phases[stream->call->phase].response_bytes += stream->bytes;
+	if (stream->curl_r == CURLE_OK) {
+		if (stream->connects == 0)
+			ctx->stats.connections_reused++;
+		else
+			ctx->stats.connections += stream->connects;
+	}
+
+	rpc_handle_response(stream->call, &fault, fault.fault_occurred ? NULL : stream->status, NULL);
+}
+
+/*
+ * moves the transfers of the streamed calls along, waiting up to timeout_ms
+ * for one of them to make progress, and completes those which are finished.
+ * curl_multi_poll() needs curl 7.66.
+ */
+static void rpc_stream_pump(struct sth_context *ctx, unsigned long timeout_ms) {
+	int running = 0;
+	int left;
+	CURLMsg *msg;
+
+	curl_multi_perform(ctx->curl_multi, &running);
+	if (running > 0 && timeout_ms > 0) {
+		curl_multi_poll(ctx->curl_multi, NULL, 0, timeout_ms, NULL);
+		curl_multi_perform(ctx->curl_multi, &running);
+	}
+
+	while ((msg = curl_multi_info_read(ctx->curl_multi, &left))) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		struct rpc_stream *stream = NULL;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &stream);
+		stream->curl_r = msg->data.result;
+		ctx->rpc_stream_count--;
+		rpc_stream_complete(stream);
+		rpc_stream_free(stream);
+	}
+}
+
+/*
+ * handles the responses arriving within timeout_ms.
+ */
+static void rpc_run(struct sth_context *ctx, unsigned long timeout_ms) {
+	if (ctx->rpc_stream_count == 0) {
+		xmlrpc_client_event_loop_finish_timeout(ctx->client, timeout_ms);
+	} else if (ctx->rpc_inflight == ctx->rpc_stream_count) {
+		rpc_stream_pump(ctx, timeout_ms);
+	} else {
+		// the event loop of xmlrpc-c can't wait for the streams, take turns
+		if (timeout_ms > 10)
+			timeout_ms = 10;
+		xmlrpc_client_event_loop_finish_timeout(ctx->client, timeout_ms);
+		rpc_stream_pump(ctx, 0);
+	}
+}
+
+static void rpc_wait_inflight(struct sth_context *ctx, int max) {
+	while (ctx->rpc_inflight > max)
+		rpc_run(ctx, 10);
+}
+
+/*
+ * waits until a request may be sent. The responses of the calls in
+ * flight are handled in the meantime.
+ */
+static void rate_acquire(struct sth_context *ctx) {
+	for (rate_refill(ctx); ctx->rate_bucket.tokens < 1; rate_refill(ctx)) {
+		double wait = (1 - ctx->rate_bucket.tokens) / ctx->rate_bucket.rate;
+		if (ctx->rpc_inflight > 0) {
+			rpc_run(ctx, wait * 1000 + 1);
+		} else {
+			struct timespec ts = { .tv_sec = wait, .tv_nsec = (wait - (time_t) wait) * 1e9 };
+			nanosleep(&ts, NULL);
+		}
+	}
+	ctx->rate_bucket.tokens -= 1;
+}
+
+static int login(struct sth_context *ctx) {
+	_cleanup_env_ xmlrpc_env env;
+	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *token_xmlval = NULL;
+	_cleanup_free_ const char *status = NULL;
+
+	xmlrpc_env_init(&env);
+
+	rate_acquire(ctx);
+	double started = stats_now();
+	xmlrpc_client_call2f(&env, ctx->client, ctx->options.server_url, "LogIn", &result, "(ssss)", "", "", LOGIN_LANGCODE, LOGIN_USER_AGENT);
+	stats_record(ctx, STATS_LOGIN, stats_now() - started);
+	stats_record_response(ctx, STATS_LOGIN, result);
+	if (env.fault_occurred) {
+		log_err("login failed: %s (%d)", env.fault_string, env.fault_code);
+		return env.fault_code;
+	}
+
+	status = struct_get_string(&env, result, "status");
+	if (!status || strcmp(status, "200 OK")) {
+		log_err("login failed: %s", status ? status : env.fault_string);
+		return 1;
+	}
+
+	xmlrpc_struct_find_value(&env, result, "token", &token_xmlval);
+	xmlrpc_read_string(&env, token_xmlval, (const char **) &ctx->session_token);
+	if (env.fault_occurred) {
+		log_err("login failed: %s (%d)", env.fault_string, env.fault_code);
+		ctx->session_token = NULL;
+		return env.fault_code;
+	}
+	ctx->session_last_used = time(NULL);
+
+	session_save(ctx);
+
+	return 0;
+}
+
+/*
+ * keeps a reused token alive, returns false if the server doesn't accept it anymore.
+ */
+static bool session_refresh(struct sth_context *ctx) {
+	_cleanup_env_ xmlrpc_env env;
+	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;
+	_cleanup_free_ const char *status = NULL;
+
+	xmlrpc_env_init(&env);
+
+	rate_acquire(ctx);
+	xmlrpc_client_call2f(&env, ctx->client, ctx->options.server_url, "NoOperation", &result, "(s)", ctx->session_token);
+	if (env.fault_occurred)
+		return false;
+
+	status = result_get_status(result);
+	if (!status || strcmp(status, "200 OK"))
+		return false;
+
+	ctx->session_last_used = time(NULL);
+	return true;
+}
+
+/*
+ * returns a valid token, logging in only if there is no usable one.
+ */
+static int session_get_token(struct sth_context *ctx, const char **token) {
+	time_t idle = time(NULL) - ctx->session_last_used;
+
+	// LogIn and NoOperation are synchronous, don't mix them with the calls in flight
+	if (!ctx->session_token || idle >= SESSION_REFRESH_AFTER || idle < 0)
+		rpc_wait_inflight(ctx, 0);
+
+	if (ctx->session_token && (idle >= SESSION_IDLE_TIMEOUT || idle < 0))
+		session_drop(ctx);
+	else if (ctx->session_token && idle >= SESSION_REFRESH_AFTER && !session_refresh(ctx))
+		session_drop(ctx);
+
+	if (!ctx->session_token) {
+		int r = login(ctx);
+		if (r != 0)
+			return r;
+	}
+
+	*token = ctx->session_token;
+	return 0;
+}
+
+static void rpc_complete(const char *url, const char *method, xmlrpc_value *param_array,
+                         void *user_data, xmlrpc_env *fault, xmlrpc_value *result) {
+	(void) url;
+	(void) method;
+	(void) param_array;
+	struct rpc_call *call = user_data;
+	struct sth_context *ctx = call->ctx;
+
+	if (!fault->fault_occurred)
+		stats_record_response(ctx, call->phase, result);
+
+	_cleanup_free_ const char *status = fault->fault_occurred ? NULL : result_get_status(result);
+	rpc_handle_response(call, fault, status, result);
+}
+
+static int rpc_start(struct sth_context *ctx, struct rpc_call *call) {
+	_cleanup_env_ xmlrpc_env env;
+	_cleanup_xmlrpc_ xmlrpc_value *all_params = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *token_xmlval = NULL;
+	const char *token;
+
+	xmlrpc_env_init(&env);
+	call->r = 0;
+	call->ctx = ctx;
+
+	rpc_wait_inflight(ctx, ctx->options.max_inflight - 1);
+	// before getting the token, a response handled meanwhile may drop it
+	rate_acquire(ctx);
+
+	int r = session_get_token(ctx, &token);
+	if (r != 0) {
+		call->r = r;
+		call->done(call, NULL);
+		return r;
+	}
+
+	all_params = xmlrpc_array_new(&env);
+	token_xmlval = xmlrpc_string_new(&env, token);
+	xmlrpc_array_append_item(&env, all_params, token_xmlval);
+
+	int n = xmlrpc_array_size(&env, call->params);
+	for (int i = 0; i < n; i++) {
+		_cleanup_xmlrpc_ xmlrpc_value *param = NULL;
+		xmlrpc_array_read_item(&env, call->params, i, &param);
+		xmlrpc_array_append_item(&env, all_params, param);
+	}
+
+	call->started = stats_now();
+	call->seconds = 0;
+	if (!env.fault_occurred && call->scan)
+		rpc_stream_start(&env, call, all_params);
+	else if (!env.fault_occurred)
+		xmlrpc_client_start_rpc(&env, ctx->client, ctx->server_info, call->method, all_params, rpc_complete, call);
+	if (env.fault_occurred) {
+		log_err("%s failed: %s (%d)", call->method, env.fault_string, env.fault_code);
+		call->r = env.fault_code;
+		call->done(call, NULL);
+		return call->r;
+	}
+
+	ctx->rpc_inflight++;
+	return 0;
+}
+
+static void rpc_finish(struct sth_context *ctx) {
+	do {
+		rpc_wait_inflight(ctx, 0);
+
+		// wait for the earliest retry; the others may become due meanwhile
+		double due = 0;
+		for (struct rpc_call *retry = ctx->rpc_retries; retry; retry = retry->next_retry) {
+			if (retry == ctx->rpc_retries || retry->retry_at < due)
+				due = retry->retry_at;
+		}
+		double wait = due - stats_now();
+		if (ctx->rpc_retries && wait > 0) {
+			struct timespec ts = { .tv_sec = wait, .tv_nsec = (wait - (time_t) wait) * 1e9 };
+			nanosleep(&ts, NULL);
+		}
+
+		// restart the calls which are due, e.g. those whose token was rejected
+		struct rpc_call *retry = ctx->rpc_retries;
+		ctx->rpc_retries = NULL;
+		double now = stats_now();
+		while (retry) {
+			struct rpc_call *next = retry->next_retry;
+			if (retry->retry_at <= now) {
+				rpc_start(ctx, retry);
+			} else {
+				retry->next_retry = ctx->rpc_retries;
+				ctx->rpc_retries = retry;
+			}
+			retry = next;
+		}
+	} while (ctx->rpc_inflight > 0 || ctx->rpc_retries);
+}
+
+/*
+ * the search results of a batch are allocated from an arena, which is freed
+ * in one step with the batch. Language codes and release names are interned,
+ * so those repeated across the results are stored only once.
+ */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	uint64_t data[];       // enough alignment for struct sth_sub_info
+};
+
+struct arena {
+	struct arena_block *blocks;
+
+	// interned strings, open addressing with linear probing
+	const char **strings;
+	size_t string_count;
+	size_t string_capacity;
+};
+
+static void *arena_alloc(struct arena *a, size_t size) {
+	size = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+
+	struct arena_block *b = a->blocks;
+	if (!b || b->size - b->used < size) {
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		b = malloc(sizeof(struct arena_block) + block_size);
+		if (!b)
+			return NULL;
+		b->used = 0;
+		b->size = block_size;
+		b->next = a->blocks;
+		a->blocks = b;
+	}
+
+	void *p = (char *) b->data + b->used;
+	b->used += size;
+	return p;
+}
+
+static const char *arena_strdup(struct arena *a, const char *s) {
+	size_t len = strlen(s) + 1;
+	char *copy = arena_alloc(a, len);
+	if (copy)
+		memcpy(copy, s, len);
+	return copy;
+}
+
+static uint64_t arena_string_hash(const char *s) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *s; s++)
+		hash = (hash ^ (unsigned char) *s) * 0x100000001b3ULL;
+	return hash;
+}
+
+static const char *arena_intern(struct arena *a, const char *s) {
+	// keep the table at most half full
+	if (2 * (a->string_count + 1) > a->string_capacity) {
+		size_t capacity = a->string_capacity ? 2 * a->string_capacity : 256;
+		const char **strings = calloc(capacity, sizeof(const char *));
+		if (!strings)
+			return NULL;
+		for (size_t i = 0; i < a->string_capacity; i++) {
+			if (!a->strings[i])
+				continue;
+			size_t j = arena_string_hash(a->strings[i]) & (capacity - 1);
+			while (strings[j])
+				j = (j + 1) & (capacity - 1);
+			strings[j] = a->strings[i];
+		}
+		free(a->strings);
+		a->strings = strings;
+		a->string_capacity = capacity;
+	}
+
+	size_t i = arena_string_hash(s) & (a->string_capacity - 1);
+	for (; a->strings[i]; i = (i + 1) & (a->string_capacity - 1)) {
+		if (strcmp(a->strings[i], s) == 0)
+			return a->strings[i];
+	}
+
+	a->strings[i] = arena_strdup(a, s);
+	if (a->strings[i])
+		a->string_count++;
+	return a->strings[i];
+}
+
+static void arena_free(struct arena *a) {
+	while (a->blocks) {
+		struct arena_block *next = a->blocks->next;
+		free(a->blocks);
+		a->blocks = next;
+	}
+	free(a->strings);
+	memset(a, 0, sizeof(*a));
+}
+
+/*
+ * one entry per input file of a batch.
+ */
+struct sth_file {
+	const char *filepath;
+	const char *filename;  // basename of filepath
+	const char *lang;      // searched for, see sth_options
+	void *data;            // of the caller, see sth_query
+	uint64_t hash;
+	uint64_t filesize;
+	int r;                 // non-zero if preparing the file failed
+	struct stat st;        // identity of the file for the hash cache
+	bool hashed;           // hash and filesize are known
+	double hash_seconds;   // only set if the file was read
+	uint64_t bytes_read;
+
+	// this file's share of the batch response, allocated from arena
+	struct arena *arena;
+	struct sth_sub_info *sub_infos;
+	int sub_count;
+	int sub_capacity;
+	bool searched;         // sub_infos is complete
+	bool search_cached;    // sub_infos came from the search cache
+	bool indexed;          // sub_infos came from the index
+	int same_as;           // 1 + index of an earlier job of the batch with the same hash and size, or 0
+	bool seen;             // sub_infos came from an earlier batch, see seen_lookup()
+	double search_seconds;
+
+	struct batch *batch;   // the job belongs to, for sth_file_choose()
+};
+
+/*
+ * appends a copy of a result to the job.
+ */
+static int job_add_sub_info(struct sth_file *job, const struct sth_sub_info *info) {
+	if (job->sub_count == job->sub_capacity) {
+		// the old array stays in the arena, which is at most as much again
+		int capacity = job->sub_capacity ? 2 * job->sub_capacity : 16;
+		struct sth_sub_info *sub_infos = arena_alloc(job->arena, capacity * sizeof(struct sth_sub_info));
+		if (!sub_infos)
+			return ENOMEM;
+		if (job->sub_count > 0)
+			memcpy(sub_infos, job->sub_infos, job->sub_count * sizeof(struct sth_sub_info));
+		job->sub_infos = sub_infos;
+		job->sub_capacity = capacity;
+	}
+
+	struct sth_sub_info *sub_info = &job->sub_infos[job->sub_count];
+	*sub_info = *info;
+	sub_info->lang = arena_intern(job->arena, info->lang);
+	sub_info->release_name = arena_intern(job->arena, info->release_name);
+	sub_info->filename = arena_strdup(job->arena, info->filename);
+	sub_info->encoding = arena_intern(job->arena, info->encoding ? info->encoding : "");
+	if (!sub_info->lang || !sub_info->release_name || !sub_info->filename || !sub_info->encoding)
+		return ENOMEM;
+
+	job->sub_count++;
+	return 0;
+}
+
+/*
+ * forgets the results of the job, their memory is released with the arena.
+ */
+static void job_clear_sub_infos(struct sth_file *job) {
+	job->sub_infos = NULL;
+	job->sub_count = 0;
+	job->sub_capacity = 0;
+}
+
+/*
+ * the results of the videos searched for by one sth_process_files() call, by
+ * hash, size and languages, so that a copy of a video in a later batch isn't
+ * searched for again. They are forgotten when the call returns, or when
+ * SEEN_MAX videos were kept. Like the search cache, it is only used with
+ * use_search_cache.
+ */
+#define SEEN_MAX 4096
+
+struct seen_entry {
+	uint64_t hash;
+	uint64_t filesize;
+	const char *lang;                // NULL for an empty slot
+	struct sth_sub_info *sub_infos;
+	int sub_count;
+};
+
+struct seen {
+	struct arena arena;              // the results and their strings
+	struct seen_entry entries[2 * SEEN_MAX]; // open addressing with linear probing
+	int count;
+};
+
+static struct seen_entry *seen_find(struct seen *seen, const struct sth_file *job) {
+	size_t mask = 2 * SEEN_MAX - 1;
+	size_t i = (job->hash ^ job->filesize * 0x9e3779b97f4a7c15ULL ^ arena_string_hash(job->lang)) & mask;
+
+	for (; seen->entries[i].lang; i = (i + 1) & mask) {
+		const struct seen_entry *e = &seen->entries[i];
+		if (e->hash == job->hash && e->filesize == job->filesize && strcmp(e->lang, job->lang) == 0)
+			break;
+	}
+	return &seen->entries[i];
+}
+
+/*
+ * copies the results of an identical video of an earlier batch to the job.
+ */
+static bool seen_lookup(struct sth_context *ctx, struct sth_file *job) {
+	if (!ctx->seen || !job->hashed || ctx->options.name_search_only)
+		return false;
+
+	const struct seen_entry *e = seen_find(ctx->seen, job);
+	if (!e->lang)
+		return false;
+
+	for (int i = 0; i < e->sub_count; i++) {
+		if (job_add_sub_info(job, &e->sub_infos[i]) != 0) {
+			job_clear_sub_infos(job);
+			return false;
+		}
+	}
+
+	job->searched = true;
+	job->seen = true;
+	return true;
+}
+
+static void seen_store(struct sth_context *ctx, const struct sth_file *job) {
+	if (!job->hashed || !ctx->options.use_search_cache || ctx->options.name_search_only)
+		return;
+
+	if (!ctx->seen) {
+		ctx->seen = calloc(1, sizeof(struct seen));
+		if (!ctx->seen)
+			return;
+	} else if (ctx->seen->count == SEEN_MAX) {
+		arena_free(&ctx->seen->arena);
+		memset(ctx->seen->entries, 0, sizeof(ctx->seen->entries));
+		ctx->seen->count = 0;
+	}
+
+	struct arena *a = &ctx->seen->arena;
+	struct seen_entry *e = seen_find(ctx->seen, job);
+	if (e->lang)
+		return;
+
+	struct sth_sub_info *sub_infos = arena_alloc(a, job->sub_count * sizeof(struct sth_sub_info) + 1);
+	const char *lang = arena_intern(a, job->lang);
+	if (!sub_infos || !lang)
+		return;
+
+	for (int i = 0; i < job->sub_count; i++) {
+		struct sth_sub_info *sub_info = &sub_infos[i];
+		*sub_info = job->sub_infos[i];
+		sub_info->lang = arena_intern(a, sub_info->lang);
+		sub_info->release_name = arena_intern(a, sub_info->release_name);
+		sub_info->filename = arena_strdup(a, sub_info->filename);
+		sub_info->encoding = arena_intern(a, sub_info->encoding);
+		if (!sub_info->lang || !sub_info->release_name || !sub_info->filename || !sub_info->encoding)
+			return;
+	}
+
+	e->hash = job->hash;
+	e->filesize = job->filesize;
+	e->sub_infos = sub_infos;
+	e->sub_count = job->sub_count;
+	e->lang = lang;
+	ctx->seen->count++;
+}
+
+static void seen_free(struct sth_context *ctx) {
+	if (ctx->seen)
+		arena_free(&ctx->seen->arena);
+	free(ctx->seen);
+	ctx->seen = NULL;
+}
+
+/*
+ * the search cache stores the results of SearchSubtitles per file in
+ * $XDG_CACHE_HOME/subberthehut/search, one file per query. The first line of
+ * a file is the query itself, followed by one tab separated line per result.
+ * Files are replaced atomically with rename(), so several processes (or hosts
+ * sharing the cache directory) can use the cache at the same time.
+ */
+
+/*
+ * tells whether the cache in dir is due to be swept, at most once per
+ * CACHE_SWEEP_INTERVAL (by any process), which the mtime of .swept tells.
+ */
+static bool cache_sweep_due(const char *dir) {
+	_cleanup_free_ char *stamp = NULL;
+	struct stat st;
+
+	if (asprintf(&stamp, "%s/.swept", dir) == -1)
+		return false;
+	if (stat(stamp, &st) == 0 && time(NULL) - st.st_mtime < CACHE_SWEEP_INTERVAL)
+		return false;
+
+	// claim the sweep first, so that processes started together don't all sweep
+	int fd = open(stamp, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return false;
+	futimens(fd, NULL);
+	close(fd);
+	return true;
+}
+
+/*
+ * removes the expired entries, and the temporary files of processes which
+ * died while storing one.
+ */
+static void search_cache_sweep(struct sth_context *ctx) {
+	time_t now = time(NULL);
+	struct stat st;
+
+	if (!cache_sweep_due(ctx->search_cache_dir))
+		return;
+
+	DIR *dir = opendir(ctx->search_cache_dir);
+	if (!dir)
+		return;
+
+	struct dirent *dirent;
+	while ((dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		if (fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode))
+			continue;
+
+		// temporary files have a suffix, and are only stored to for a moment
+		bool tmp = strchr(dirent->d_name, '.') != NULL;
+		if (now - st.st_mtime > (tmp ? SEARCH_CACHE_EMPTY_TTL : ctx->options.search_cache_ttl))
+			unlinkat(dirfd(dir), dirent->d_name, 0);
+	}
+
+	closedir(dir);
+}
+
+static int search_cache_open(struct sth_context *ctx) {
+	_cleanup_free_ char *dir = get_cache_dir();
+
+	if (!dir || asprintf(&ctx->search_cache_dir, "%s/search", dir) == -1)
+		return ENOMEM;
+
+	if (mkdir(ctx->search_cache_dir, 0755) == -1 && errno != EEXIST)
+		return errno;
+
+	search_cache_sweep(ctx);
+	return 0;
+}
+
+static void search_cache_close(struct sth_context *ctx) {
+	free(ctx->search_cache_dir);
+	ctx->search_cache_dir = NULL;
+}
+
+/*
+ * everything that influences the results of a file's query, on a single line.
+ */
+static char *search_cache_key(struct sth_context *ctx, const struct sth_file *job) {
+	char mode = ctx->options.hash_search_only ? 'h' : ctx->options.name_search_only ? 'n' : 'b';
+	char *key;
+
+	int r = asprintf(&key, "%s %016" PRIx64 " %" PRIu64 " %c %s %d %s",
+	                 ctx->options.server_url,
+	                 ctx->options.name_search_only ? 0 : job->hash,
+	                 ctx->options.name_search_only ? 0 : job->filesize,
+	                 mode, job->lang, ctx->options.limit,
+	                 ctx->options.hash_search_only ? "" : job->filename);
+	if (r == -1)
+		return NULL;
+
+	// the name search is case insensitive
+	for (char *c = key; *c; c++)
+		*c = *c == '\n' ? ' ' : tolower((unsigned char) *c);
+
+	return key;
+}
+
+static char *search_cache_path(struct sth_context *ctx, const char *key) {
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (const char *c = key; *c; c++)
+		h = (h ^ (unsigned char) *c) * 0x100000001b3ULL;
+
+	char *path;
+	if (asprintf(&path, "%s/%016" PRIx64, ctx->search_cache_dir, h) == -1)
+		return NULL;
+	return path;
+}
+
+/*
+ * fills job->sub_infos from the cache, returns false if there is no valid entry.
+ */
+static bool search_cache_lookup(struct sth_context *ctx, struct sth_file *job) {
+	_cleanup_free_ char *key = search_cache_key(ctx, job);
+	_cleanup_free_ char *path = key ? search_cache_path(ctx, key) : NULL;
+	_cleanup_fclose_ FILE *f = NULL;
+	_cleanup_free_ char *line = NULL;
+	size_t len = 0;
+	ssize_t line_len;
+	struct stat st;
+
+	if (!path)
+		return false;
+
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	if (fstat(fileno(f), &st) == -1)
+		return false;
+	time_t age = time(NULL) - st.st_mtime;
+	if (age > ctx->options.search_cache_ttl)
+		return false;
+
+	// the key guards against collisions of the file name
+	line_len = getline(&line, &len, f);
+	if (line_len <= 0 || line[line_len - 1] != '\n')
+		return false;
+	line[line_len - 1] = '\0';
+	if (strcmp(line, key))
+		return false;
+
+	while ((line_len = getline(&line, &len, f)) > 0) {
+		if (line[line_len - 1] == '\n')
+			line[line_len - 1] = '\0';
+
+		char *fields[11];
+		char *next = line;
+		int i;
+		for (i = 0; i < 11 && next; i++)
+			fields[i] = strsep(&next, "\t");
+
+		if (i != 11 || next) {
+			job_clear_sub_infos(job);
+			return false;
+		}
+
+		struct sth_sub_info sub_info = {
+			.id = strtol(fields[0], NULL, 10),
+			.matched_by_hash = fields[1][0] == 'H',
+			.lang = fields[2],
+			.release_name = fields[3],
+			.filename = fields[4],
+			.fps = strtof(fields[5], NULL),
+			.downloads = strtol(fields[6], NULL, 10),
+			.rating = strtof(fields[7], NULL),
+			.uploader_rank = strtol(fields[8], NULL, 10),
+			.bad = fields[9][0] == '1',
+			.encoding = fields[10],
+		};
+		if (job_add_sub_info(job, &sub_info) != 0) {
+			job_clear_sub_infos(job);
+			return false;
+		}
+	}
+
+	if (job->sub_count == 0 && age > SEARCH_CACHE_EMPTY_TTL)
+		return false;
+
+	job->searched = true;
+	job->search_cached = true;
+	return true;
+}
+
+static void search_cache_write_field(FILE *f, const char *s) {
+	for (; *s; s++)
+		putc(*s == '\t' || *s == '\n' ? ' ' : *s, f);
+}
+
+static void search_cache_store(struct sth_context *ctx, const struct sth_file *job) {
+	_cleanup_free_ char *key = search_cache_key(ctx, job);
+	_cleanup_free_ char *path = key ? search_cache_path(ctx, key) : NULL;
+	_cleanup_free_ char *tmp_path = NULL;
+	_cleanup_fclose_ FILE *f = NULL;
+
+	if (!path || asprintf(&tmp_path, "%s.XXXXXX", path) == -1)
+		return;
+
+	int fd = mkstemp(tmp_path);
+	if (fd == -1)
+		return;
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp_path);
+		return;
+	}
+
+	fprintf(f, "%s\n", key);
+	for (int i = 0; i < job->sub_count; i++) {
+		const struct sth_sub_info *sub_info = &job->sub_infos[i];
+		fprintf(f, "%d\t%c\t", sub_info->id, sub_info->matched_by_hash ? 'H' : 'N');
+		search_cache_write_field(f, sub_info->lang);
+		putc('\t', f);
+		search_cache_write_field(f, sub_info->release_name);
+		putc('\t', f);
+		search_cache_write_field(f, sub_info->filename);
+		fprintf(f, "\t%g\t%d\t%g\t%d\t%d\t", sub_info->fps, sub_info->downloads, sub_info->rating,
+		        sub_info->uploader_rank, sub_info->bad);
+		search_cache_write_field(f, sub_info->encoding);
+		putc('\n', f);
+	}
+
+	int r = fclose(f);
+	f = NULL;
+	if (r != 0 || rename(tmp_path, path) == -1)
+		unlink(tmp_path);
+}
+
+/*
+ * the index (--index) maps the hash and size of videos to the subtitles of a
+ * local mirror, so that they are found without asking the server. It is
+ * built by --build-index from the manifest of the mirror's directory and
+ * read with mmap. The keys are sorted and kept apart from the entries, so a
+ * lookup is a binary search over a small array:
+ *
+ *   header | keys[key_count] | entries[entry_count] | strings[strings_size]
+ *
+ * Strings are NUL terminated and referenced by their offset, paths are
+ * relative to the directory of the index.
+ */
+struct index_key {
+	uint64_t hash;
+	uint64_t size;
+	uint32_t first;    // index of the first entry of the video
+	uint32_t count;
+};
+
+struct index_entry {
+	int32_t id;        // the subtitle file's ID on OpenSubtitles.org, 0 if unknown
+	float fps;         // 0 if unknown
+	uint32_t lang;
+	uint32_t release_name;
+	uint32_t filename;
+	uint32_t path;
+};
+
+struct index_header {
+	char magic[8];
+	uint64_t key_count;
+	uint64_t entry_count;
+	uint64_t strings_size;
+	struct index_key keys[];
+};
+
+static int index_open(struct sth_context *ctx, const char *dir) {
+	_cleanup_close_ int fd = -1;
+	_cleanup_free_ char *path = NULL;
+	struct stat st;
+
+	if (asprintf(&path, "%s/" INDEX_FILE, dir) == -1)
+		return ENOMEM;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1)
+		return errno;
+
+	if ((uint64_t) st.st_size < sizeof(struct index_header))
+		return EINVAL;
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return errno;
+
+	const struct index_header *header = map;
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->key_count > (uint64_t) st.st_size / sizeof(struct index_key) ||
+	    header->entry_count > (uint64_t) st.st_size / sizeof(struct index_entry) ||
+	    header->strings_size > (uint64_t) st.st_size ||
+	    sizeof(struct index_header) + header->key_count * sizeof(struct index_key) +
+	    header->entry_count * sizeof(struct index_entry) + header->strings_size != (uint64_t) st.st_size) {
+		munmap(map, st.st_size);
+		return EINVAL;
+	}
+
+	// the strings are at the end, the last one must end within the map
+	const char *end = (const char *) map + st.st_size;
+	if (header->strings_size > 0 && end[-1] != '\0') {
+		munmap(map, st.st_size);
+		return EINVAL;
+	}
+
+	ctx->index_dir = strdup(dir);
+	if (!ctx->index_dir) {
+		munmap(map, st.st_size);
+		return ENOMEM;
+	}
+
+	ctx->index_map = map;
+	ctx->index_map_size = st.st_size;
+	return 0;
+}
+
+static void index_close(struct sth_context *ctx) {
+	if (ctx->index_map)
+		munmap(ctx->index_map, ctx->index_map_size);
+	free(ctx->index_dir);
+	ctx->index_map = NULL;
+	ctx->index_dir = NULL;
+}
+
+static const struct index_entry *index_entries(struct sth_context *ctx) {
+	return (const struct index_entry *) &ctx->index_map->keys[ctx->index_map->key_count];
+}
+
+static const char *index_string(struct sth_context *ctx, uint32_t offset) {
+	const char *strings = (const char *) &index_entries(ctx)[ctx->index_map->entry_count];
+	return offset < ctx->index_map->strings_size ? &strings[offset] : "";
+}
+
+/*
+ * checks if a language is one of langs, e.g. --lang.
+ */
+static bool lang_requested(const char *langs, const char *code) {
+	if (strcmp(langs, "all") == 0)
+		return true;
+
+	size_t len = strlen(code);
+	for (const char *l = langs; *l; ) {
+		size_t l_len = strcspn(l, ",");
+		if (l_len == len && strncasecmp(l, code, len) == 0)
+			return true;
+		l += l_len;
+		if (*l == ',')
+			l++;
+	}
+	return false;
+}
+
+/*
+ * fills job->sub_infos from the index, returns false if it has no subtitles
+ * of the languages searched for.
+ */
+static bool index_lookup(struct sth_context *ctx, struct sth_file *job) {
+	uint64_t lo = 0;
+	uint64_t hi = ctx->index_map->key_count;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		const struct index_key *key = &ctx->index_map->keys[mid];
+		if (key->hash < job->hash || (key->hash == job->hash && key->size < job->filesize))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == ctx->index_map->key_count)
+		return false;
+
+	const struct index_key *key = &ctx->index_map->keys[lo];
+	if (key->hash != job->hash || key->size != job->filesize ||
+	    (uint64_t) key->first + key->count > ctx->index_map->entry_count)
+		return false;
+
+	for (uint32_t i = 0; i < key->count && job->sub_count < ctx->options.limit; i++) {
+		const struct index_entry *entry = &index_entries(ctx)[key->first + i];
+		if (!lang_requested(job->lang, index_string(ctx, entry->lang)))
+			continue;
+
+		struct sth_sub_info sub_info = {
+			.id = entry->id,
+			.fps = entry->fps,
+			.matched_by_hash = true,
+			.lang = index_string(ctx, entry->lang),
+			.release_name = index_string(ctx, entry->release_name),
+			.filename = index_string(ctx, entry->filename),
+			.local_path = index_string(ctx, entry->path),
+		};
+		if (job_add_sub_info(job, &sub_info) != 0) {
+			job_clear_sub_infos(job);
+			return false;
+		}
+	}
+
+	if (job->sub_count == 0)
+		return false;
+
+	job->searched = true;
+	job->indexed = true;
+	return true;
+}
+
+/*
+ * a line of the manifest, see index_build().
+ */
+struct manifest_entry {
+	uint64_t hash;
+	uint64_t size;
+	int id;
+	float fps;
+	char *lang;
+	char *release_name;
+	char *path;
+	int line;          // keeps the order of the manifest for equal keys
+};
+
+static int compare_manifest_entries(const void *a, const void *b) {
+	const struct manifest_entry *x = a;
+	const struct manifest_entry *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+	return x->line - y->line;
+}
+
+/*
+ * appends a string to the string table of the index being built, and stores
+ * its offset. The offsets are 32-bit, the table can't grow beyond that.
+ */
+static int index_add_string(char **strings, size_t *size, size_t *capacity, const char *s, uint32_t *offset) {
+	size_t len = strlen(s) + 1;
+
+	if (*size > UINT32_MAX - len)
+		return EFBIG;
+
+	if (*size + len > *capacity) {
+		size_t new_capacity = *capacity ? 2 * *capacity : 4096;
+		while (new_capacity < *size + len)
+			new_capacity *= 2;
+		char *new_strings = realloc(*strings, new_capacity);
+		if (!new_strings)
+			return ENOMEM;
+		*strings = new_strings;
+		*capacity = new_capacity;
+	}
+
+	*offset = *size;
+	memcpy(*strings + *size, s, len);
+	*size += len;
+	return 0;
+}
+
+/*
+ * --build-index: reads dir/manifest.tsv and writes dir/index for --index.
+ * The manifest has a line per subtitle with tab separated fields:
+ *
+ *   moviehash  bytesize  language  path  [subtitle ID  [fps  [release name]]]
+ *
+ * The path is relative to dir, subtitles ending in .gz are decompressed
+ * when they are used. Empty lines and lines starting with # are skipped.
+ */
+int sth_build_index(const char *dir) {
+	_cleanup_free_ char *manifest_path = NULL;
+	_cleanup_free_ char *path = NULL;
+	_cleanup_free_ char *tmp_path = NULL;
+	_cleanup_fclose_ FILE *manifest = NULL;
+	_cleanup_free_ char *line = NULL;
+	_cleanup_free_ char *strings = NULL;
+	_cleanup_free_ struct index_key *keys = NULL;
+	_cleanup_free_ struct index_entry *entries = NULL;
+	_cleanup_close_ int fd = -1;
+	struct manifest_entry *manifest_entries = NULL;
+	int count = 0;
+	int capacity = 0;
+	size_t strings_size = 0;
+	size_t strings_capacity = 0;
+	size_t len = 0;
+	ssize_t line_len;
+	int line_number = 0;
+	int r = 0;
+
+	if (asprintf(&manifest_path, "%s/" INDEX_MANIFEST_FILE, dir) == -1 ||
+	    asprintf(&path, "%s/" INDEX_FILE, dir) == -1 ||
+	    asprintf(&tmp_path, "%s.XXXXXX", path) == -1)
+		return log_oom();
+
+	manifest = fopen(manifest_path, "re");
+	if (!manifest) {
+		log_err("failed to open %s: %m", manifest_path);
+		return errno;
+	}
+
+	while ((line_len = getline(&line, &len, manifest)) > 0) {
+		line_number++;
+		if (line[line_len - 1] == '\n')
+			line[--line_len] = '\0';
+		if (line_len == 0 || line[0] == '#')
+			continue;
+
+		char *fields[7] = { NULL };
+		char *next = line;
+		int n;
+		for (n = 0; n < 7 && next; n++)
+			fields[n] = strsep(&next, "\t");
+
+		char *hash_end = NULL;
+		char *size_end = NULL;
+		struct manifest_entry e = {
+			.hash = n >= 4 ? strtoull(fields[0], &hash_end, 16) : 0,
+			.size = n >= 4 ? strtoull(fields[1], &size_end, 10) : 0,
+			.id = n >= 5 ? strtol(fields[4], NULL, 10) : 0,
+			.fps = n >= 6 ? strtof(fields[5], NULL) : 0,
+			.line = line_number,
+		};
+		if (n < 4 || next || *hash_end != '\0' || *size_end != '\0' || !*fields[2] || !*fields[3]) {
+			log_err("%s:%d: invalid line, skipping it.", manifest_path, line_number);
+			continue;
+		}
+
+		_cleanup_free_ char *sub_path = NULL;
+		if (asprintf(&sub_path, "%s/%s", dir, fields[3]) == -1) {
+			r = log_oom();
+			goto finish;
+		}
+		if (access(sub_path, R_OK) == -1) {
+			log_err("%s:%d: %s: %m, skipping it.", manifest_path, line_number, fields[3]);
+			continue;
+		}
+
+		if (count == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			struct manifest_entry *new_entries = realloc(manifest_entries, capacity * sizeof(struct manifest_entry));
+			if (!new_entries) {
+				r = log_oom();
+				goto finish;
+			}
+			manifest_entries = new_entries;
+		}
+
+		e.lang = strdup(fields[2]);
+		e.path = strdup(fields[3]);
+		e.release_name = strdup(n >= 7 ? fields[6] : "");
+		manifest_entries[count++] = e;
+		if (!e.lang || !e.path || !e.release_name) {
+			r = log_oom();
+			goto finish;
+		}
+	}
+
+	qsort(manifest_entries, count, sizeof(struct manifest_entry), compare_manifest_entries);
+
+	keys = malloc(count * sizeof(struct index_key) + 1);
+	entries = malloc(count * sizeof(struct index_entry) + 1);
+	if (!keys || !entries) {
+		r = log_oom();
+		goto finish;
+	}
+
+	uint64_t key_count = 0;
+	for (int i = 0; i < count; i++) {
+		const struct manifest_entry *e = &manifest_entries[i];
+
+		if (key_count == 0 || keys[key_count - 1].hash != e->hash || keys[key_count - 1].size != e->size) {
+			keys[key_count++] = (struct index_key) { .hash = e->hash, .size = e->size, .first = i };
+		}
+		keys[key_count - 1].count++;
+
+		// the name to show, without the .gz of a compressed subtitle
+		const char *filename = strrchr(e->path, '/');
+		_cleanup_free_ char *name = strdup(filename ? filename + 1 : e->path);
+		if (!name) {
+			r = log_oom();
+			goto finish;
+		}
+		size_t name_len = strlen(name);
+		if (name_len > 3 && strcmp(name + name_len - 3, ".gz") == 0)
+			name[name_len - 3] = '\0';
+
+		entries[i] = (struct index_entry) { .id = e->id, .fps = e->fps };
+		r = index_add_string(&strings, &strings_size, &strings_capacity, e->lang, &entries[i].lang);
+		if (r == 0)
+			r = index_add_string(&strings, &strings_size, &strings_capacity, e->release_name, &entries[i].release_name);
+		if (r == 0)
+			r = index_add_string(&strings, &strings_size, &strings_capacity, name, &entries[i].filename);
+		if (r == 0)
+			r = index_add_string(&strings, &strings_size, &strings_capacity, e->path, &entries[i].path);
+		if (r == EFBIG) {
+			log_err("%s has too many strings for one index, split it.", manifest_path);
+			goto finish;
+		}
+		if (r != 0) {
+			r = log_oom();
+			goto finish;
+		}
+	}
+
+	struct index_header header = {
+		.key_count = key_count,
+		.entry_count = count,
+		.strings_size = strings_size,
+	};
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+
+	fd = mkstemp(tmp_path);
+	if (fd == -1) {
+		log_err("failed to write %s: %m", path);
+		r = errno;
+		goto finish;
+	}
+	fchmod(fd, 0644);
+
+	r = write_full(fd, (const unsigned char *) &header, sizeof(header));
+	if (r == 0)
+		r = write_full(fd, (const unsigned char *) keys, key_count * sizeof(struct index_key));
+	if (r == 0)
+		r = write_full(fd, (const unsigned char *) entries, count * sizeof(struct index_entry));
+	if (r == 0)
+		r = write_full(fd, (const unsigned char *) strings, strings_size);
+	if (r == 0 && rename(tmp_path, path) == -1)
+		r = errno;
+	if (r != 0) {
+		log_err("failed to write %s: %s", path, strerror(r));
+		unlink(tmp_path);
+		goto finish;
+	}
+
+	log_info("indexed %d subtitles of %" PRIu64 " videos.", count, key_count);
+
+finish:
+	for (int i = 0; i < count; i++) {
+		free(manifest_entries[i].lang);
+		free(manifest_entries[i].release_name);
+		free(manifest_entries[i].path);
+	}
+	free(manifest_entries);
+	return r;
+}
+
+/*
+ * maps one result of a batched SearchSubtitles call back to the file it belongs to.
+ * OpenSubtitles.org tags each result with the index of the query that produced it,
+ * MovieHash/MovieByteSize is only used as a fallback.
+ */
+static int result_get_job(const char *query_number, const char *hash_str, const char *filesize_str,
+                          const int *query_jobs, int query_count, const struct sth_file *jobs, int n) {
+	if (*query_number) {
+		char *endptr = NULL;
+		long q = strtol(query_number, &endptr, 10);
+		if (*endptr == '\0' && q >= 0 && q < query_count)
+			return query_jobs[q];
+	}
+
+	if (!*hash_str || !*filesize_str)
+		return -1;
+
+	uint64_t hash = strtoull(hash_str, NULL, 16);
+	uint64_t filesize = strtoull(filesize_str, NULL, 10);
+	for (int i = 0; i < n; i++) {
+		if (jobs[i].r == 0 && jobs[i].hash == hash && jobs[i].filesize == filesize)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * the members of the search result being scanned which are needed,
+ * longer values are cut off.
+ */
+enum {
+	RESULT_ID           = 1 << 0,
+	RESULT_MATCHED_BY   = 1 << 1,
+	RESULT_LANG         = 1 << 2,
+	RESULT_RELEASE_NAME = 1 << 3,
+	RESULT_FILENAME     = 1 << 4,
+	RESULT_COMPLETE     = (1 << 5) - 1,
+};
+
+struct search_result {
+	unsigned int members; // RESULT_* that were seen
+	char query_number[16];
+	char hash[24];
+	char filesize[24];
+	char id[16];
+	char matched_by[16];
+	char lang[16];
+	char release_name[512];
+	char filename[NAME_MAX + 1];
+	char fps[16];
+	char downloads[16];
+	char rating[16];
+	char uploader_rank[32];
+	char bad[4];
+	char encoding[32];
+};
+
+static void search_result_clear(struct search_result *result) {
+	result->members = 0;
+	result->query_number[0] = '\0';
+	result->hash[0] = '\0';
+	result->filesize[0] = '\0';
+	result->fps[0] = '\0';
+	result->downloads[0] = '\0';
+	result->rating[0] = '\0';
+	result->uploader_rank[0] = '\0';
+	result->bad[0] = '\0';
+	result->encoding[0] = '\0';
+}
+
+/*
+ * 2 for the uploaders OpenSubtitles.org trusts most, 1 for the other ranked ones.
+ */
+static unsigned char get_uploader_rank(const char *rank) {
+	static const char *const trusted[] = {
+		"administrator", "platinum member", "gold member", "trusted", NULL
+	};
+	for (int i = 0; trusted[i]; i++) {
+		if (strcmp(rank, trusted[i]) == 0)
+			return 2;
+	}
+	return strstr(rank, "member") ? 1 : 0;
+}
+
+/*
+ * a SearchSubtitles call for all files of a batch that weren't searched for yet.
+ */
+struct search_call {
+	struct rpc_call call;
+	struct sth_file *jobs;
+	int n;
+	int *query_jobs; // query index -> job index
+	int query_count;
+
+	struct search_result result;
+	int scan_r;
+};
+
+static void search_add_result(struct search_call *search) {
+	struct search_result *result = &search->result;
+
+	int j = result_get_job(result->query_number, result->hash, result->filesize,
+	                       search->query_jobs, search->query_count, search->jobs, search->n);
+	if (j < 0) {
+		log_err("warning: ignoring a search result that matches none of the files.");
+	} else if (result->members != RESULT_COMPLETE) {
+		log_err("invalid search result: a member is missing.");
+		search->scan_r = XMLRPC_PARSE_ERROR;
+	} else {
+		struct sth_sub_info sub_info = {
+			// dear OpenSubtitles.org, why are these IDs provided as strings?
+			.id = strtol(result->id, NULL, 10),
+			.matched_by_hash = strcmp(result->matched_by, "moviehash") == 0,
+			.lang = result->lang,
+			.release_name = result->release_name,
+			.filename = result->filename,
+			.fps = strtof(result->fps, NULL),
+			.downloads = strtol(result->downloads, NULL, 10),
+			.rating = strtof(result->rating, NULL),
+			.uploader_rank = get_uploader_rank(result->uploader_rank),
+			.bad = strcmp(result->bad, "1") == 0,
+			.encoding = result->encoding,
+		};
+		if (job_add_sub_info(&search->jobs[j], &sub_info) != 0)
+			search->scan_r = log_oom();
+	}
+
+	search_result_clear(result);
+}
+
+/*
+ * copies a member of a result. A value that doesn't fit is cut at the start
+ * of a UTF-8 sequence, not within one.
+ */
+static void search_result_set(struct search_result *result, unsigned int member, const char *name,
+                              char *buf, size_t size, const char *value) {
+	size_t len = strlen(value);
+	if (len >= size) {
+		len = size - 1;
+		while (len > 0 && ((unsigned char) value[len] & 0xc0) == 0x80)
+			len--;
+		log_err("warning: %s of a search result is too long, cut to %zu bytes.", name, len);
+	}
+
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+	result->members |= member;
+}
+
+/*
+ * distributes the results to jobs[i].sub_infos while they arrive, from
+ * rpc_run(). Nothing else touches the jobs of the batch before rpc_finish().
+ */
+static void search_scan(struct rpc_call *call, enum scan_event event, int depth,
+                        const char *parent, const char *name, const char *value) {
+	struct search_call *search = (struct search_call *) call;
+	struct search_result *result = &search->result;
+
+	switch (event) {
+	case SCAN_BEGIN:
+		for (int i = 0; i < search->query_count; i++)
+			job_clear_sub_infos(&search->jobs[search->query_jobs[i]]);
+		search_result_clear(result);
+		search->scan_r = 0;
+		return;
+
+	case SCAN_MEMBER:
+		// the results are the structs in the "data" array
+		if (depth != 2 || !parent || strcmp(parent, "data"))
+			return;
+
+		if (strcmp(name, "QueryNumber") == 0)
+			search_result_set(result, 0, name, result->query_number, sizeof(result->query_number), value);
+		else if (strcmp(name, "MovieHash") == 0)
+			search_result_set(result, 0, name, result->hash, sizeof(result->hash), value);
+		else if (strcmp(name, "MovieByteSize") == 0)
+			search_result_set(result, 0, name, result->filesize, sizeof(result->filesize), value);
+		else if (strcmp(name, "IDSubtitleFile") == 0)
+			search_result_set(result, RESULT_ID, name, result->id, sizeof(result->id), value);
+		else if (strcmp(name, "MatchedBy") == 0)
+			search_result_set(result, RESULT_MATCHED_BY, name, result->matched_by, sizeof(result->matched_by), value);
+		else if (strcmp(name, "SubLanguageID") == 0)
+			search_result_set(result, RESULT_LANG, name, result->lang, sizeof(result->lang), value);
+		else if (strcmp(name, "MovieReleaseName") == 0)
+			search_result_set(result, RESULT_RELEASE_NAME, name, result->release_name, sizeof(result->release_name), value);
+		else if (strcmp(name, "SubFileName") == 0)
+			search_result_set(result, RESULT_FILENAME, name, result->filename, sizeof(result->filename), value);
+		else if (strcmp(name, "MovieFPS") == 0)
+			search_result_set(result, 0, name, result->fps, sizeof(result->fps), value);
+		else if (strcmp(name, "SubDownloadsCnt") == 0)
+			search_result_set(result, 0, name, result->downloads, sizeof(result->downloads), value);
+		else if (strcmp(name, "SubRating") == 0)
+			search_result_set(result, 0, name, result->rating, sizeof(result->rating), value);
+		else if (strcmp(name, "UserRank") == 0)
+			search_result_set(result, 0, name, result->uploader_rank, sizeof(result->uploader_rank), value);
+		else if (strcmp(name, "SubBad") == 0)
+			search_result_set(result, 0, name, result->bad, sizeof(result->bad), value);
+		else if (strcmp(name, "SubEncoding") == 0)
+			search_result_set(result, 0, name, result->encoding, sizeof(result->encoding), value);
+		return;
+
+	case SCAN_STRUCT_END:
+		if (depth == 2 && parent && strcmp(parent, "data") == 0)
+			search_add_result(search);
+		return;
+	}
+}
+
+/*
+ * the results were already distributed by search_scan().
+ */
+static void search_done(struct rpc_call *call, xmlrpc_value *result) {
+	struct search_call *search = (struct search_call *) call;
+	(void) result;
+
+	if (call->r == 0)
+		call->r = search->scan_r;
+
+	for (int i = 0; i < search->query_count; i++) {
+		struct sth_file *job = &search->jobs[search->query_jobs[i]];
+		job->search_seconds = call->seconds;
+		if (call->r == 0)
+			job->searched = true;
+		else
+			job_clear_sub_infos(job);
+	}
+}
+
+static void search_free(struct search_call *search) {
+	if (search->call.params)
+		xmlrpc_DECREF(search->call.params);
+	free(search->query_jobs);
+	memset(search, 0, sizeof(*search));
+}
+
+/*
+ * starts searching subtitles for all files of a batch with a single
+ * SearchSubtitles call. The results are available after rpc_finish(),
+ * search->call.r is set on failure.
+ */
+static int search_start(struct sth_context *ctx, struct search_call *search, struct sth_file *jobs, int n) {
+	_cleanup_env_ xmlrpc_env env;
+	_cleanup_xmlrpc_ xmlrpc_value *query_array = NULL;
+
+	_cleanup_xmlrpc_ xmlrpc_value *limit_xmlval = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *param_struct = NULL;
+
+	xmlrpc_env_init(&env);
+
+	search->call.method = "SearchSubtitles";
+	search->call.done = search_done;
+	search->call.scan = search_scan;
+	search->call.phase = STATS_SEARCH;
+	search->jobs = jobs;
+	search->n = n;
+	search->query_jobs = malloc(2 * n * sizeof(int));
+	if (!search->query_jobs)
+		return search->call.r = log_oom();
+
+	query_array = xmlrpc_array_new(&env);
+
+	for (int i = 0; i < n; i++) {
+		_cleanup_xmlrpc_ xmlrpc_value *hash_query = NULL;
+		_cleanup_xmlrpc_ xmlrpc_value *name_query = NULL;
+		_cleanup_xmlrpc_ xmlrpc_value *sublanguageid_xmlval = NULL;
+		_cleanup_xmlrpc_ xmlrpc_value *hash_xmlval = NULL;
+		_cleanup_xmlrpc_ xmlrpc_value *filesize_xmlval = NULL;
+		_cleanup_xmlrpc_ xmlrpc_value *filename_xmlval = NULL;
+		_cleanup_free_ char *hash_str = NULL;
+		_cleanup_free_ char *filesize_str = NULL;
+
+		if (jobs[i].r != 0 || jobs[i].searched || jobs[i].same_as)
+			continue;
+
+		sublanguageid_xmlval = xmlrpc_string_new(&env, jobs[i].lang);
+
+		// create hash-based query
+		if (!ctx->options.name_search_only) {
+			hash_query = xmlrpc_struct_new(&env);
+			xmlrpc_struct_set_value(&env, hash_query, "sublanguageid", sublanguageid_xmlval);
+			int r = asprintf(&hash_str, "%016" PRIx64, jobs[i].hash);
+			if (r == -1)
+				return search->call.r = log_oom();
+
+			hash_xmlval = xmlrpc_string_new(&env, hash_str);
+			xmlrpc_struct_set_value(&env, hash_query, "moviehash", hash_xmlval);
+
+			r = asprintf(&filesize_str, "%" PRIu64, jobs[i].filesize);
+			if (r == -1)
+				return search->call.r = log_oom();
+
+			filesize_xmlval = xmlrpc_string_new(&env, filesize_str);
+			xmlrpc_struct_set_value(&env, hash_query, "moviebytesize", filesize_xmlval);
+
+			xmlrpc_array_append_item(&env, query_array, hash_query);
+			search->query_jobs[search->query_count++] = i;
+		}
+
+		// create full-text query
+		if (!ctx->options.hash_search_only) {
+			name_query = xmlrpc_struct_new(&env);
+			xmlrpc_struct_set_value(&env, name_query, "sublanguageid", sublanguageid_xmlval);
+
+			filename_xmlval = xmlrpc_string_new(&env, jobs[i].filename);
+			xmlrpc_struct_set_value(&env, name_query, "query", filename_xmlval);
+
+			xmlrpc_array_append_item(&env, query_array, name_query);
+			search->query_jobs[search->query_count++] = i;
+		}
+	}
+
+	if (search->query_count == 0)
+		return 0;
+
+	// create parameter structure (currently only for "limit")
+	param_struct = xmlrpc_struct_new(&env);
+	limit_xmlval = xmlrpc_int_new(&env, ctx->options.limit);
+	xmlrpc_struct_set_value(&env, param_struct, "limit", limit_xmlval);
+
+	search->call.params = xmlrpc_build_value(&env, "(AS)", query_array, param_struct);
+	if (env.fault_occurred) {
+		log_err("failed to create query: %s (%d)", env.fault_string, env.fault_code);
+		return search->call.r = env.fault_code;
+	}
+
+	return rpc_start(ctx, &search->call);
+}
+
+/*
+ * a subtitle to download and where to write it to.
+ */
+struct sub_download {
+	int id;
+	const char *filepath; // destination, owned by the sub_download_list it is in
+	const struct sth_sink *sink; // destination instead of filepath
+	const char *source;   // a subtitle of the index to copy instead, see sth_sub_info
+	const char *encoding; // see sth_sub_info
+	int job;              // index of the file in its batch
+	int r;
+	bool written;
+
+	double download_seconds;
+	double decode_seconds;
+	uint64_t bytes_written;
+};
+
+/*
+ * the subtitles chosen without asking, to be downloaded together.
+ */
+struct sub_download_list {
+	struct sub_download *dls;
+	int count;
+	int capacity;
+};
+
+static struct sub_download *sub_download_add(struct sub_download_list *list) {
+	if (list->count == list->capacity) {
+		int capacity = list->capacity ? 2 * list->capacity : 16;
+		struct sub_download *dls = realloc(list->dls, capacity * sizeof(struct sub_download));
+		if (!dls)
+			return NULL;
+		list->dls = dls;
+		list->capacity = capacity;
+	}
+
+	struct sub_download *dl = &list->dls[list->count++];
+	memset(dl, 0, sizeof(*dl));
+	return dl;
+}
+
+static void sub_download_list_free(struct sub_download_list *list) {
+	for (int i = 0; i < list->count; i++)
+		free((void *)list->dls[i].filepath);
+	free(list->dls);
+	memset(list, 0, sizeof(*list));
+}
+
+/*
+ * --utf8, --unix-newlines and --strip-bom: a subtitle is converted while it
+ * is written, a chunk at a time, so that it is written only once.
+ */
+struct recode {
+	bool utf8;
+	bool unix_newlines;
+	bool strip_bom;
+	const char *encoding;  // of the subtitle according to the server, NULL if unknown
+	iconv_t cd;            // (iconv_t) -1 if the subtitle isn't converted
+	bool detected;
+	bool started;          // past the beginning, i.e. a BOM
+	bool cr;               // the last chunk ended in \r, which was held back
+	unsigned char *buf;
+	size_t capacity;
+};
+
+/*
+ * checks if s is valid UTF-8, except for a sequence cut off at the end.
+ */
+static bool is_utf8(const unsigned char *s, size_t len) {
+	size_t i = 0;
+
+	while (i < len) {
+		unsigned char c = s[i];
+		int n = c < 0x80 ? 0 : (c & 0xe0) == 0xc0 ? 1 : (c & 0xf0) == 0xe0 ? 2 : (c & 0xf8) == 0xf0 ? 3 : -1;
+		if (n < 0 || (n == 1 && c < 0xc2))
+			return false;
+
+		for (int j = 1; j <= n; j++) {
+			if (i + j == len)
+				return true;
+			if ((s[i + j] & 0xc0) != 0x80)
+				return false;
+		}
+		i += n + 1;
+	}
+	return true;
+}
+
+/*
+ * the encoding of a subtitle from its first chunk: a BOM, valid UTF-8, the
+ * encoding the server reports or, if it reports none, a guess between the
+ * most common Western and Cyrillic code pages.
+ */
+static const char *detect_encoding(const unsigned char *s, size_t len, const char *server_encoding) {
+	if (len >= 2 && ((s[0] == 0xff && s[1] == 0xfe) || (s[0] == 0xfe && s[1] == 0xff)))
+		return "UTF-16";
+	if (is_utf8(s, len))
+		return "UTF-8";
+	if (server_encoding && *server_encoding && strcasecmp(server_encoding, "UTF-8") != 0)
+		return server_encoding;
+
+	// Cyrillic text has mostly non-ASCII letters, Western text a few accented ones
+	size_t ascii = 0;
+	size_t high = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (isalpha(s[i]))
+			ascii++;
+		else if (s[i] >= 0xc0)
+			high++;
+	}
+	return high > ascii ? "CP1251" : "CP1252";
+}
+
+/*
+ * converts a chunk of a subtitle and writes it to sink. An incomplete sequence
+ * at the end of the chunk is left for the next one, *consumed tells where it
+ * starts. last is set for the last chunk.
+ */
+static int recode_write(struct recode *rc, const struct sth_sink *sink, const unsigned char *in, size_t len, bool last,
+                        size_t *consumed, uint64_t *written) {
+	if (!rc->detected) {
+		rc->detected = true;
+		rc->cd = (iconv_t) -1;
+
+		const char *from = rc->utf8 ? detect_encoding(in, len, rc->encoding) : "UTF-8";
+		if (strcasecmp(from, "UTF-8") != 0) {
+			rc->cd = iconv_open("UTF-8", from);
+			if (rc->cd == (iconv_t) -1)
+				log_err("warning: can't convert the subtitle from %s, writing it as it is.", from);
+		}
+	}
+
+	// UTF-8 takes at most 3 bytes per input byte, plus the \r held back
+	if (rc->capacity < 3 * len + 16) {
+		size_t capacity = 3 * len + 16;
+		unsigned char *buf = realloc(rc->buf, capacity);
+		if (!buf)
+			return log_oom();
+		rc->buf = buf;
+		rc->capacity = capacity;
+	}
+
+	unsigned char *out = rc->buf + 1;
+	size_t out_len;
+
+	*consumed = len;
+	if (rc->cd == (iconv_t) -1) {
+		memcpy(out, in, len);
+		out_len = len;
+	} else {
+		char *in_p = (char *) in;
+		size_t in_left = len;
+		char *out_p = (char *) out;
+		size_t out_left = rc->capacity - 1;
+
+		while (in_left > 0 && iconv(rc->cd, &in_p, &in_left, &out_p, &out_left) == (size_t) -1) {
+			if (errno == EINVAL && !last)
+				break;
+			if (errno == E2BIG || out_left < 3) {
+				log_err("failed to convert the subtitle: %m");
+				return E2BIG;
+			}
+
+			// replace an invalid byte (or an incomplete sequence at the end) with U+FFFD
+			in_p++;
+			in_left--;
+			memcpy(out_p, "\xef\xbf\xbd", 3);
+			out_p += 3;
+			out_left -= 3;
+		}
+		if (last)
+			iconv(rc->cd, NULL, NULL, &out_p, &out_left);
+
+		*consumed = len - in_left;
+		out_len = out_p - (char *) out;
+	}
+
+	if (rc->strip_bom && !rc->started && out_len >= 3 && memcmp(out, "\xef\xbb\xbf", 3) == 0) {
+		out += 3;
+		out_len -= 3;
+	}
+	rc->started = true;
+
+	if (rc->unix_newlines) {
+		if (rc->cr) {
+			*--out = '\r';
+			out_len++;
+			rc->cr = false;
+		}
+
+		size_t n = 0;
+		for (size_t i = 0; i < out_len; i++) {
+			if (out[i] == '\r' && i + 1 == out_len && !last) {
+				rc->cr = true;
+				break;
+			}
+			if (out[i] == '\r' && i + 1 < out_len && out[i + 1] == '\n')
+				continue;
+			out[n++] = out[i];
+		}
+		out_len = n;
+	}
+
+	int r = sink->write(sink->data, out, out_len);
+	if (r != 0) {
+		log_err("failed to write subtitle: %s", strerror(r));
+		return r;
+	}
+	*written += out_len;
+	return 0;
+}
+
+static void recode_free(struct recode *rc) {
+	if (rc->detected && rc->cd != (iconv_t) -1)
+		iconv_close(rc->cd);
+	free(rc->buf);
+}
+
+/*
+ * decompresses a gzipped subtitle and writes it to sink, converted
+ * as struct recode describes; encoding is the one the server reports. The
+ * number of bytes written is stored in *written.
+ * The output buffer is large enough for most subtitles, so they
+ * are written with a single write().
+ */
+static int sub_write(struct sth_context *ctx, const unsigned char *sub_gz, size_t sub_gz_len,
+                     const struct sth_sink *sink, const char *encoding, uint64_t *written) {
+	// zlib stuff, see also http://zlib.net/zlib_how.html
+	int z_ret;
+	z_stream z_strm;
+	_cleanup_free_ unsigned char *z_out = NULL;
+	z_strm.zalloc = Z_NULL;
+	z_strm.zfree = Z_NULL;
+	z_strm.opaque = Z_NULL;
+	z_strm.next_in = (unsigned char *) sub_gz;
+	z_strm.avail_in = sub_gz_len;
+
+	int r = 0;
+
+	struct recode rc = {
+		.utf8 = ctx->options.utf8,
+		.unix_newlines = ctx->options.unix_newlines,
+		.strip_bom = ctx->options.strip_bom,
+		.encoding = encoding,
+	};
+	bool recoding = ctx->options.utf8 || ctx->options.unix_newlines || ctx->options.strip_bom;
+	size_t carry = 0; // bytes at the start of z_out left over by recode_write()
+
+	*written = 0;
+
+	z_out = malloc(ZLIB_CHUNK);
+	if (!z_out)
+		return log_oom();
+
+	// 16+MAX_WBITS is needed for gzip support
+	z_ret = inflateInit2(&z_strm, 16 + MAX_WBITS);
+	if (z_ret != Z_OK) {
+		log_err("failed to init zlib (%i)", z_ret);
+		return z_ret;
+	}
+
+	do {
+		z_strm.avail_out = ZLIB_CHUNK - carry;
+		z_strm.next_out = z_out + carry;
+		z_ret = inflate(&z_strm, Z_NO_FLUSH);
+
+		switch (z_ret) {
+		case Z_BUF_ERROR:
+			// no progress possible, i.e. all input is consumed before the end of the stream
+			log_err("subtitle data is truncated.");
+			r = Z_DATA_ERROR;
+			goto finish;
+		case Z_NEED_DICT:
+			z_ret = Z_DATA_ERROR;
+			// fallthrough
+		case Z_DATA_ERROR:
+		case Z_MEM_ERROR:
+			r = z_ret;
+			log_err("zlib error: %s (%d)", z_strm.msg, z_ret);
+			goto finish;
+		}
+
+		// write decompressed data from z_out to the sink
+		size_t len = ZLIB_CHUNK - z_strm.avail_out;
+		if (recoding) {
+			size_t consumed;
+			r = recode_write(&rc, sink, z_out, len, z_ret == Z_STREAM_END, &consumed, written);
+			if (r != 0)
+				goto finish;
+			carry = len - consumed;
+			memmove(z_out, z_out + consumed, carry);
+			continue;
+		}
+
+		r = sink->write(sink->data, z_out, len);
+		if (r != 0) {
+			log_err("failed to write subtitle: %s", strerror(r));
+			goto finish;
+		}
+		*written += len;
+	} while (z_ret != Z_STREAM_END);
+
+finish:
+	inflateEnd(&z_strm);
+	recode_free(&rc);
+
+	return r;
+}
+
+/*
+ * writes the subtitle source of the index to sink, like sub_write()
+ * does for downloaded ones. Subtitles ending in .gz are decompressed.
+ */
+static int sub_copy(struct sth_context *ctx, const char *source, const struct sth_sink *sink, uint64_t *written) {
+	_cleanup_free_ char *path = NULL;
+	_cleanup_close_ int fd = -1;
+	struct stat st;
+	int r = 0;
+
+	*written = 0;
+
+	if (asprintf(&path, "%s/%s", ctx->index_dir, source) == -1)
+		return log_oom();
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		r = errno;
+		log_err("failed to open %s: %s", path, strerror(r));
+		return r;
+	}
+
+	const unsigned char *sub = (const unsigned char *) "";
+	if (st.st_size > 0) {
+		sub = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (sub == MAP_FAILED) {
+			r = errno;
+			log_err("failed to read %s: %s", path, strerror(r));
+			return r;
+		}
+	}
+
+	size_t len = strlen(source);
+	if (len > 3 && strcmp(source + len - 3, ".gz") == 0) {
+		r = sub_write(ctx, sub, st.st_size, sink, NULL, written);
+	} else if (ctx->options.utf8 || ctx->options.unix_newlines || ctx->options.strip_bom) {
+		struct recode rc = {
+			.utf8 = ctx->options.utf8,
+			.unix_newlines = ctx->options.unix_newlines,
+			.strip_bom = ctx->options.strip_bom,
+		};
+		size_t consumed;
+		r = recode_write(&rc, sink, sub, st.st_size, true, &consumed, written);
+		recode_free(&rc);
+	} else {
+		r = sink->write(sink->data, sub, st.st_size);
+		if (r != 0)
+			log_err("failed to write subtitle: %s", strerror(r));
+		else
+			*written = st.st_size;
+	}
+
+	if (st.st_size > 0)
+		munmap((void *) sub, st.st_size);
+	return r;
+}
+
+/*
+ * the sink a download is written to: the caller's, or one writing to the
+ * file it is for, which is opened into *fd. An existing file (with -f) is
+ * replaced instead of written to, earlier versions hard linked it into the blob store.
+ */
+static int sub_open_sink(const struct sub_download *dl, int *fd, struct sth_sink *sink) {
+	if (dl->sink) {
+		*sink = *dl->sink;
+		return 0;
+	}
+
+	if (unlink(dl->filepath) == -1 && errno != ENOENT) {
+		int r = errno;
+		log_err("failed to replace %s: %s", dl->filepath, strerror(r));
+		return r;
+	}
+
+	*fd = open(dl->filepath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (*fd == -1) {
+		int r = errno;
+		log_err("failed to open %s for writing: %s", dl->filepath, strerror(r));
+		return r;
+	}
+
+	sink->write = fd_sink_write;
+	sink->data = fd;
+	return 0;
+}
+
+/*
+ * --blob-store: the subtitles written are kept in $XDG_CACHE_HOME/subberthehut/blobs,
+ * named after the SHA-256 of their content, and linked from
+ * id/<IDSubtitleFile> (with a suffix for the options that change the content).
+ * A subtitle found there isn't downloaded again: its destination is cloned
+ * (FICLONE) from the store, or copied if that doesn't work. It is never hard
+ * linked, the user could edit the store through it otherwise. Using a
+ * subtitle touches it, those not used for BLOB_STORE_TTL are removed.
+ */
+
+/*
+ * removes the regular files in dir which weren't used for BLOB_STORE_TTL.
+ * Temporary files (with a suffix) and blobs no ID links to anymore are
+ * removed after an hour, once nobody is about to link to them.
+ */
+static void blob_store_sweep_dir(const char *path, time_t now) {
+	struct stat st;
+
+	DIR *dir = opendir(path);
+	if (!dir)
+		return;
+
+	struct dirent *dirent;
+	while ((dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		if (fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode))
+			continue;
+
+		bool unused = strchr(dirent->d_name, '.') != NULL || st.st_nlink == 1;
+		if (now - st.st_mtime > (unused ? 60 * 60 : BLOB_STORE_TTL))
+			unlinkat(dirfd(dir), dirent->d_name, 0);
+	}
+
+	closedir(dir);
+}
+
+static int blob_store_open(struct sth_context *ctx) {
+	_cleanup_free_ char *dir = get_cache_dir();
+	_cleanup_free_ char *id_dir = NULL;
+
+	if (!dir || asprintf(&ctx->blob_dir, "%s/blobs", dir) == -1 || asprintf(&id_dir, "%s/id", ctx->blob_dir) == -1)
+		return ENOMEM;
+
+	if (mkdir(ctx->blob_dir, 0755) == -1 && errno != EEXIST)
+		return errno;
+	if (mkdir(id_dir, 0755) == -1 && errno != EEXIST)
+		return errno;
+
+	// the IDs first, so that the blobs only they linked to go in the same sweep
+	if (cache_sweep_due(ctx->blob_dir)) {
+		blob_store_sweep_dir(id_dir, time(NULL));
+		blob_store_sweep_dir(ctx->blob_dir, time(NULL));
+	}
+	return 0;
+}
+
+static void blob_store_close(struct sth_context *ctx) {
+	free(ctx->blob_dir);
+	ctx->blob_dir = NULL;
+}
+
+static char *blob_id_path(struct sth_context *ctx, int id) {
+	char *path;
+
+	if (asprintf(&path, "%s/id/%d%s%s%s", ctx->blob_dir, id, ctx->options.utf8 ? "-utf8" : "",
+	             ctx->options.unix_newlines ? "-lf" : "", ctx->options.strip_bom ? "-nobom" : "") == -1)
+		return NULL;
+	return path;
+}
+
+/*
+ * writes the content of the blob open at fd to sink.
+ */
+static int blob_write(int fd, off_t size, const struct sth_sink *sink, uint64_t *written) {
+	const unsigned char *data = (const unsigned char *) "";
+	if (size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+			return errno;
+	}
+
+	int r = sink->write(sink->data, data, size);
+	if (size > 0)
+		munmap((void *) data, size);
+	if (r == 0)
+		*written = size;
+	return r;
+}
+
+/*
+ * puts a copy of the blob at dest, preferably a clone that shares its data
+ * but not its inode.
+ */
+static int blob_place(const char *blob, const char *dest, uint64_t *written) {
+	_cleanup_close_ int fd = -1;
+	_cleanup_close_ int dest_fd = -1;
+	struct stat st;
+
+	*written = 0;
+
+	fd = open(blob, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1)
+		return errno;
+
+	// dest is always replaced, never written to: an earlier version may have
+	// made it a hard link to a blob.
+	unlink(dest);
+	dest_fd = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (dest_fd == -1)
+		return errno;
+	if (ioctl(dest_fd, FICLONE, fd) == 0) {
+		*written = st.st_size;
+		return 0;
+	}
+
+	struct sth_sink sink = { fd_sink_write, &dest_fd };
+	return blob_write(fd, st.st_size, &sink, written);
+}
+
+/*
+ * writes the subtitle dl is waiting for from the store, if it is there.
+ */
+static bool blob_store_place(struct sth_context *ctx, struct sub_download *dl) {
+	_cleanup_free_ char *id_path = blob_id_path(ctx, dl->id);
+	uint64_t written;
+	int r;
+
+	if (!id_path || access(id_path, R_OK) == -1)
+		return false;
+
+	if (dl->sink) {
+		_cleanup_close_ int fd = open(id_path, O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd == -1 || fstat(fd, &st) == -1)
+			r = errno;
+		else
+			r = blob_write(fd, st.st_size, dl->sink, &written);
+	} else {
+		r = blob_place(id_path, dl->filepath, &written);
+	}
+	if (r != 0) {
+		log_err("warning: failed to use subtitle %d of the blob store: %s", dl->id, strerror(r));
+		return false;
+	}
+
+	// keeps it from being swept, the blob and all its IDs share the inode
+	utimensat(AT_FDCWD, id_path, NULL, 0);
+
+	dl->written = true;
+	dl->bytes_written += written;
+	ctx->stats.bytes_written += written;
+	ctx->stats.blob_hits++;
+	return true;
+}
+
+/*
+ * adds a subtitle that was just written to the store. Subtitles with the
+ * same content (under another ID) share their blob.
+ */
+static void blob_store_add(struct sth_context *ctx, int id, const char *filepath) {
+	_cleanup_free_ char *id_path = blob_id_path(ctx, id);
+	_cleanup_free_ char *blob_path = NULL;
+	_cleanup_free_ char *tmp_path = NULL;
+	_cleanup_close_ int fd = -1;
+	gchar *sha256 = NULL;
+	struct stat st;
+
+	if (!id_path || access(id_path, F_OK) == 0)
+		return;
+
+	fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1)
+		return;
+
+	const unsigned char *data = (const unsigned char *) "";
+	if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+			return;
+	}
+
+	// a cryptographic hash, so that no subtitle can be made to take the place of another
+	sha256 = g_compute_checksum_for_data(G_CHECKSUM_SHA256, data, st.st_size);
+	if (!sha256 || asprintf(&blob_path, "%s/%s", ctx->blob_dir, sha256) == -1)
+		goto finish;
+
+	if (access(blob_path, F_OK) == -1) {
+		if (asprintf(&tmp_path, "%s.XXXXXX", blob_path) == -1)
+			goto finish;
+
+		int tmp_fd = mkstemp(tmp_path);
+		if (tmp_fd == -1)
+			goto finish;
+
+		int r = write_full(tmp_fd, data, st.st_size);
+		fchmod(tmp_fd, 0444);
+		if (close(tmp_fd) != 0 || r != 0 || rename(tmp_path, blob_path) == -1) {
+			unlink(tmp_path);
+			goto finish;
+		}
+	}
+
+	// another process may have added it in the meantime, which is fine
+	if (link(blob_path, id_path) == -1 && errno != EEXIST)
+		log_err("warning: failed to add subtitle %d to the blob store: %m", id);
+	else
+		utimensat(AT_FDCWD, blob_path, NULL, 0);
+
+finish:
+	g_free(sha256);
+	if (st.st_size > 0)
+		munmap((void *) data, st.st_size);
+}
+
+/*
+ * a DownloadSubtitles call for up to DOWNLOAD_CHUNK subtitles.
+ */
+struct download_call {
+	struct rpc_call call;
+	struct sub_download *dls;
+	int n;
+};
+
+/*
+ * decodes the returned subtitles and routes them to the downloads by their ID,
+ * while the other calls are still in flight.
+ */
+static void download_done(struct rpc_call *call, xmlrpc_value *result) {
+	struct download_call *download = (struct download_call *) call;
+	struct sth_context *ctx = call->ctx;
+	_cleanup_env_ xmlrpc_env env;
+	_cleanup_xmlrpc_ xmlrpc_value *data = NULL; // result -> data
+
+	for (int j = 0; j < download->n; j++) {
+		if (download->dls[j].r == 0)
+			download->dls[j].download_seconds += call->seconds;
+	}
+
+	if (!result)
+		return;
+
+	xmlrpc_env_init(&env);
+
+	xmlrpc_struct_read_value(&env, result, "data", &data);
+	int data_length = 0;
+	if (!env.fault_occurred && xmlrpc_value_type(data) == XMLRPC_TYPE_ARRAY)
+		data_length = xmlrpc_array_size(&env, data);
+	if (env.fault_occurred) {
+		log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
+		call->r = env.fault_code;
+		return;
+	}
+
+	// route data[i] to every download waiting for its ID
+	for (int i = 0; i < data_length; i++) {
+		_cleanup_xmlrpc_ xmlrpc_value *data_i = NULL;     // result -> data[i]
+		_cleanup_free_ const char *sub_id_str = NULL;     // result -> data[i][idsubtitlefile]
+		_cleanup_free_ char *sub_base64 = NULL;           // result -> data[i][data], gzipped and base64 encoded
+
+		xmlrpc_array_read_item(&env, data, i, &data_i);
+		sub_id_str = struct_get_string(&env, data_i, "idsubtitlefile");
+		sub_base64 = (char *) struct_get_string(&env, data_i, "data");
+		if (env.fault_occurred) {
+			log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
+			call->r = env.fault_code;
+			return;
+		}
+
+		// decode in place, in one pass over the whole payload
+		double started = stats_now();
+		gsize sub_gz_len = strlen(sub_base64);
+		const unsigned char *sub_gz = g_base64_decode_inplace(sub_base64, &sub_gz_len);
+		double decoded = stats_now();
+
+		int sub_id = strtol(sub_id_str, NULL, 10);
+		for (int j = 0; j < download->n; j++) {
+			struct sub_download *dl = &download->dls[j];
+			if (dl->r != 0 || dl->written || dl->id != sub_id)
+				continue;
+
+			double write_started = stats_now();
+			_cleanup_close_ int fd = -1;
+			struct sth_sink sink;
+			uint64_t written = 0;
+			dl->r = sub_open_sink(dl, &fd, &sink);
+			if (dl->r == 0)
+				dl->r = sub_write(ctx, sub_gz, sub_gz_len, &sink, dl->encoding, &written);
+			// only files are added, their content can be read back
+			if (dl->r == 0 && ctx->blob_dir && !dl->sink)
+				blob_store_add(ctx, dl->id, dl->filepath);
+			dl->written = true;
+			dl->decode_seconds += decoded - started + stats_now() - write_started;
+			dl->bytes_written += written;
+			ctx->stats.bytes_written += written;
+		}
+		stats_record(ctx, STATS_DECODE, stats_now() - started);
+	}
+}
+
+/*
+ * starts downloading all subtitles in dls, DOWNLOAD_CHUNK per call.
+ * The calls are returned in *downloads and must be passed to
+ * sub_download_finish() after rpc_finish().
+ */
+static int sub_download_start(struct sth_context *ctx, struct sub_download *dls, int n, struct download_call **downloads) {
+	_cleanup_env_ xmlrpc_env env;
+	int count = (n + DOWNLOAD_CHUNK - 1) / DOWNLOAD_CHUNK;
+
+	xmlrpc_env_init(&env);
+
+	*downloads = calloc(count, sizeof(struct download_call));
+	if (!*downloads) {
+		for (int i = 0; i < n; i++)
+			dls[i].r = ENOMEM;
+		return log_oom();
+	}
+
+	// check if files already exist
+	for (int i = 0; i < n; i++) {
+		dls[i].r = 0;
+		dls[i].written = false;
+		if (!dls[i].sink && access(dls[i].filepath, F_OK) == 0) {
+			if (ctx->options.force_overwrite) {
+				log_info("%s already exists, overwriting.", dls[i].filepath);
+			} else {
+				log_err("%s already exists, aborting. Use -f to force an overwrite.", dls[i].filepath);
+				dls[i].r = EEXIST;
+			}
+		}
+
+		if (dls[i].r == 0 && dls[i].source) {
+			double started = stats_now();
+			_cleanup_close_ int fd = -1;
+			struct sth_sink sink;
+			uint64_t written = 0;
+			dls[i].r = sub_open_sink(&dls[i], &fd, &sink);
+			if (dls[i].r == 0)
+				dls[i].r = sub_copy(ctx, dls[i].source, &sink, &written);
+			dls[i].written = true;
+			dls[i].decode_seconds += stats_now() - started;
+			dls[i].bytes_written += written;
+			ctx->stats.bytes_written += written;
+		} else if (dls[i].r == 0 && ctx->blob_dir) {
+			blob_store_place(ctx, &dls[i]);
+		}
+	}
+
+	for (int c = 0; c < count; c++) {
+		_cleanup_xmlrpc_ xmlrpc_value *query_array = NULL;
+		struct download_call *download = &(*downloads)[c];
+
+		download->call.method = "DownloadSubtitles";
+		download->call.done = download_done;
+		download->call.phase = STATS_DOWNLOAD;
+		download->dls = &dls[c * DOWNLOAD_CHUNK];
+		download->n = n - c * DOWNLOAD_CHUNK < DOWNLOAD_CHUNK ? n - c * DOWNLOAD_CHUNK : DOWNLOAD_CHUNK;
+
+		query_array = xmlrpc_array_new(&env);
+		int query_count = 0;
+		for (int i = 0; i < download->n; i++) {
+			if (download->dls[i].r != 0 || download->dls[i].written)
+				continue;
+
+			// request each ID only once, even if several files want it
+			bool duplicate = false;
+			for (int j = 0; j < i; j++) {
+				if (download->dls[j].r == 0 && !download->dls[j].written &&
+				    download->dls[j].id == download->dls[i].id)
+					duplicate = true;
+			}
+			if (duplicate)
+				continue;
+
+			_cleanup_xmlrpc_ xmlrpc_value *sub_id_xmlval = xmlrpc_int_new(&env, download->dls[i].id);
+			xmlrpc_array_append_item(&env, query_array, sub_id_xmlval);
+			query_count++;
+		}
+
+		if (query_count == 0)
+			continue;
+
+		download->call.params = xmlrpc_build_value(&env, "(A)", query_array);
+		if (env.fault_occurred) {
+			log_err("failed to create query: %s (%d)", env.fault_string, env.fault_code);
+			download->call.r = env.fault_code;
+			xmlrpc_env_clean(&env);
+			xmlrpc_env_init(&env);
+			continue;
+		}
+
+		rpc_start(ctx, &download->call);
+	}
+
+	return 0;
+}
+
+/*
+ * stores the result for each subtitle in dls[i].r; if a whole call
+ * failed, its error is returned as well.
+ */
+static int sub_download_finish(struct download_call *downloads, struct sub_download *dls, int n) {
+	int r = 0;
+
+	for (int i = 0; downloads && i < n; i++) {
+		struct download_call *download = &downloads[i / DOWNLOAD_CHUNK];
+		if (download->call.r != 0)
+			r = download->call.r;
+
+		if (dls[i].r == 0 && !dls[i].written) {
+			if (download->call.r != 0) {
+				dls[i].r = download->call.r;
+			} else {
+				log_err("no data for subtitle %i received.", dls[i].id);
+				dls[i].r = 1;
+			}
+		}
+	}
+
+	for (int c = 0; downloads && c < (n + DOWNLOAD_CHUNK - 1) / DOWNLOAD_CHUNK; c++) {
+		if (downloads[c].call.params)
+			xmlrpc_DECREF(downloads[c].call.params);
+	}
+	free(downloads);
+
+	return r;
+}
+
+/*
+ * downloads all subtitles in dls and waits for them.
+ */
+static int sub_download(struct sth_context *ctx, struct sub_download *dls, int n) {
+	struct download_call *downloads = NULL;
+
+	int r = sub_download_start(ctx, dls, n, &downloads);
+	if (r != 0)
+		return r;
+
+	rpc_finish(ctx);
+
+	return sub_download_finish(downloads, dls, n);
+}
+
+/*
+ * the lower case alphanumeric words of a name, each only once.
+ */
+#define TOKENS_MAX 32
+#define TOKEN_LEN  24
+
+struct tokens {
+	int count;
+	char token[TOKENS_MAX][TOKEN_LEN];
+};
+
+static void tokenize(const char *s, bool strip_extension, struct tokens *t) {
+	const char *end = s + strlen(s);
+	const char *ext = strrchr(s, '.');
+	if (strip_extension && ext && end - ext <= 5)
+		end = ext;
+
+	t->count = 0;
+	while (s < end && t->count < TOKENS_MAX) {
+		while (s < end && !isalnum((unsigned char) *s))
+			s++;
+
+		char *token = t->token[t->count];
+		size_t len = 0;
+		for (; s < end && isalnum((unsigned char) *s); s++) {
+			if (len < TOKEN_LEN - 1)
+				token[len++] = tolower((unsigned char) *s);
+		}
+		if (len == 0)
+			break;
+		token[len] = '\0';
+
+		bool duplicate = false;
+		for (int i = 0; i < t->count && !duplicate; i++)
+			duplicate = strcmp(t->token[i], token) == 0;
+		if (!duplicate)
+			t->count++;
+	}
+}
+
+/*
+ * the Jaccard index of the words, from 0 (none in common) to 1 (the same).
+ */
+static double token_similarity(const struct tokens *a, const struct tokens *b) {
+	int common = 0;
+	for (int i = 0; i < a->count; i++) {
+		for (int j = 0; j < b->count; j++) {
+			if (strcmp(a->token[i], b->token[j]) == 0) {
+				common++;
+				break;
+			}
+		}
+	}
+
+	int total = a->count + b->count - common;
+	return total ? (double) common / total : 0;
+}
+
+/*
+ * the weights are SCORE_*. Results with the same score stay in the order the
+ * server returned them.
+ */
+void sth_rank(const char *filepath, struct sth_sub_info *sub_infos, int n) {
+	struct tokens video;
+	struct tokens tokens;
+	const char *filename = strrchr(filepath, '/');
+
+	tokenize(filename ? filename + 1 : filepath, true, &video);
+
+	// the frame rate of the video is only known from the hash matches
+	float fps = 0;
+	for (int i = 0; i < n && fps == 0; i++) {
+		if (sub_infos[i].matched_by_hash)
+			fps = sub_infos[i].fps;
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct sth_sub_info *sub_info = &sub_infos[i];
+		double score = sub_info->matched_by_hash ? SCORE_HASH : 0;
+
+		tokenize(sub_info->release_name, false, &tokens);
+		double similarity = token_similarity(&video, &tokens);
+		tokenize(sub_info->filename, true, &tokens);
+		double filename_similarity = token_similarity(&video, &tokens);
+		if (filename_similarity > similarity)
+			similarity = filename_similarity;
+		score += SCORE_SIMILARITY * similarity;
+
+		if (fps == 0 || sub_info->fps == 0)
+			score += SCORE_FPS / 2.0;
+		else if (sub_info->fps - fps < 0.01f && fps - sub_info->fps < 0.01f)
+			score += SCORE_FPS;
+
+		int digits = 0;
+		for (int d = sub_info->downloads; d > 0 && digits < 4; d /= 10)
+			digits++;
+		score += SCORE_DOWNLOADS * digits / 4.0;
+
+		score += SCORE_RATING * sub_info->rating / 10;
+		score += SCORE_UPLOADER * sub_info->uploader_rank / 2.0;
+		if (sub_info->bad)
+			score -= SCORE_BAD;
+
+		sub_info->score = score < 0 ? 0 : score > 100 ? 100 : (int) (score + 0.5);
+	}
+
+	// insertion sort, which is stable
+	for (int i = 1; i < n; i++) {
+		struct sth_sub_info sub_info = sub_infos[i];
+		int j = i;
+		for (; j > 0 && sub_infos[j - 1].score < sub_info.score; j--)
+			sub_infos[j] = sub_infos[j - 1];
+		sub_infos[j] = sub_info;
+	}
+}
+
+/*
+ * opens the file and gets its hash/filesize, if needed for the search.
+ */
+static int prepare_file(struct sth_context *ctx, struct sth_file *job) {
+	_cleanup_close_ int fd = -1;
+
+	job->filename = strrchr(job->filepath, '/');
+	if (job->filename)
+		job->filename++; // skip '/'
+	else
+		job->filename = job->filepath;
+
+	// get hash/filesize
+	if (!ctx->options.name_search_only && !job->hashed) {
+		fd = open(job->filepath, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			log_err("failed to open %s: %m", job->filepath);
+			return errno;
+		}
+
+		double started = stats_now();
+		// the identity of the file that was read is what goes into the hash cache
+		int r = get_hash_and_filesize(fd, &job->hash, &job->filesize, &job->st);
+		job->hash_seconds = stats_now() - started;
+		if (r != 0) {
+			log_err("failed to read %s: %s", job->filepath, strerror(r));
+			return r;
+		}
+		job->hashed = true;
+		// both windows, or the whole of a smaller file
+		job->bytes_read = job->filesize < HASH_CHUNK ? job->filesize : 2 * HASH_CHUNK;
+	}
+
+	return 0;
+}
+
+struct hash_pool {
+	struct sth_context *ctx; // only its options are read by the workers
+	struct sth_file *jobs;
+	int n;
+	int next; // index of the next job to prepare, shared by all workers
+	int finished; // number of workers that returned
+};
+
+static void *hash_worker(void *p) {
+	struct hash_pool *pool = p;
+
+	int i;
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->n) {
+		if (pool->jobs[i].r == 0)
+			pool->jobs[i].r = prepare_file(pool->ctx, &pool->jobs[i]);
+	}
+
+	__atomic_add_fetch(&pool->finished, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * prepares all jobs of a batch with up to hash_threads threads,
+ * so that slow storage is kept busy with several files at once.
+ * Files found in the hash cache aren't opened at all. The responses to the
+ * calls in flight (the downloads of the previous batch) are handled meanwhile.
+ */
+static void prepare_files(struct sth_context *ctx, struct sth_file *jobs, int n) {
+	struct hash_pool pool = { .ctx = ctx, .jobs = jobs, .n = n, .next = 0 };
+
+	bool cached = ctx->options.use_hash_cache && !ctx->options.name_search_only && ctx->hash_cache;
+	if (cached) {
+		flock(ctx->hash_cache_fd, LOCK_SH);
+		for (int i = 0; i < n; i++) {
+			struct sth_file *job = &jobs[i];
+			if (job->hashed)
+				continue;
+			if (stat(job->filepath, &job->st) == -1) {
+				job->r = errno;
+				log_err("failed to stat %s: %s", job->filepath, strerror(job->r));
+				continue;
+			}
+			if (S_ISREG(job->st.st_mode) && hash_cache_lookup(ctx, &job->st, &job->hash)) {
+				job->filesize = job->st.st_size;
+				job->hashed = true;
+				ctx->stats.hash_cache_hits++;
+			}
+		}
+		flock(ctx->hash_cache_fd, LOCK_UN);
+	}
+
+	int thread_count = ctx->options.hash_threads < n ? ctx->options.hash_threads : n;
+	pthread_t threads[thread_count];
+	int started = 0;
+
+	// the calling thread is one of the workers, unless it has responses to
+	// handle. The workers don't touch anything the callbacks do.
+	bool pump = ctx->rpc_inflight > 0;
+	for (; started < thread_count - (pump ? 0 : 1); started++) {
+		if (pthread_create(&threads[started], NULL, hash_worker, &pool) != 0)
+			break;
+	}
+
+	while (pump && ctx->rpc_inflight > 0 && __atomic_load_n(&pool.finished, __ATOMIC_ACQUIRE) < started)
+		rpc_run(ctx, 10);
+
+	// whatever is left, e.g. when no thread could be started
+	hash_worker(&pool);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	// the workers only touch their jobs, the totals are kept here
+	for (int i = 0; i < n; i++) {
+		if (jobs[i].hash_seconds > 0)
+			stats_record(ctx, STATS_HASH, jobs[i].hash_seconds);
+		ctx->stats.bytes_read += jobs[i].bytes_read;
+	}
+
+	if (cached) {
+		flock(ctx->hash_cache_fd, LOCK_EX);
+		for (int i = 0; i < n; i++) {
+			struct sth_file *job = &jobs[i];
+			if (job->r == 0 && job->hashed && job->st.st_ino != 0 &&
+			    (uint64_t) job->st.st_size == job->filesize)
+				hash_cache_store(ctx, &job->st, job->hash);
+		}
+		flock(ctx->hash_cache_fd, LOCK_UN);
+	}
+}
+
+/*
+ * keeps the numbers of a finished file for sth_stats_write().
+ */
+static void stats_add_file(struct sth_context *ctx, const struct sth_file *job, const struct sub_download *dl) {
+	if (job->r != 0)
+		ctx->stats.failed++;
+
+	if (!ctx->options.stats)
+		return;
+
+	if (ctx->stats.file_count == ctx->stats.file_capacity) {
+		int capacity = ctx->stats.file_capacity ? 2 * ctx->stats.file_capacity : 64;
+		struct stats_file *files = realloc(ctx->stats.files, capacity * sizeof(struct stats_file));
+		if (!files)
+			return;
+		ctx->stats.files = files;
+		ctx->stats.file_capacity = capacity;
+	}
+
+	struct stats_file *file = &ctx->stats.files[ctx->stats.file_count];
+	memset(file, 0, sizeof(*file));
+	file->filepath = strdup(job->filepath);
+	if (!file->filepath)
+		return;
+
+	file->r = job->r;
+	file->seconds[STATS_HASH] = job->hash_seconds;
+	file->seconds[STATS_SEARCH] = job->search_seconds;
+	file->seconds[STATS_DOWNLOAD] = dl->download_seconds;
+	file->seconds[STATS_DECODE] = dl->decode_seconds;
+	file->bytes_read = job->bytes_read;
+	file->bytes_written = dl->bytes_written;
+	ctx->stats.file_count++;
+}
+
+/*
+ * up to batch_size files: all of them are searched for with one
+ * SearchSubtitles call, then the subtitles are chosen file by file and
+ * downloaded with as few DownloadSubtitles calls as possible.
+ */
+struct batch {
+	struct sth_context *ctx;
+	struct sth_file *jobs;
+	struct sub_download *dls;     // per job, the totals of its downloads
+	int n;
+	int processed;                // number of jobs whose subtitle was chosen (or failed)
+	int r;                        // non-zero if the whole batch failed
+	struct arena arena;           // the search results of the jobs
+
+	struct search_call search;
+	struct sub_download_list chosen; // the subtitles to download, of all jobs
+	struct download_call *downloads;
+};
+
+static void batch_free(struct batch *b) {
+	if (!b)
+		return;
+
+	search_free(&b->search);
+	arena_free(&b->arena);
+	sub_download_list_free(&b->chosen);
+	free(b->dls);
+	free(b->jobs);
+	free(b);
+}
+
+static struct batch *batch_new(struct sth_context *ctx, char **filepaths, int n) {
+	struct batch *b = calloc(1, sizeof(struct batch));
+	if (!b)
+		return NULL;
+
+	b->ctx = ctx;
+	b->n = n;
+	b->jobs = calloc(n, sizeof(struct sth_file));
+	b->dls = calloc(n, sizeof(struct sub_download));
+	if (!b->jobs || !b->dls) {
+		batch_free(b);
+		return NULL;
+	}
+
+	for (int i = 0; i < n; i++) {
+		b->jobs[i].filepath = filepaths[i];
+		b->jobs[i].lang = ctx->options.lang;
+		b->jobs[i].arena = &b->arena;
+		b->jobs[i].batch = b;
+	}
+
+	return b;
+}
+
+/*
+ * hashes the files and starts the search for those not found in the search cache.
+ */
+static void batch_start_search(struct sth_context *ctx, struct batch *b) {
+	prepare_files(ctx, b->jobs, b->n);
+
+	for (int i = 0; i < b->n; i++) {
+		if (b->jobs[i].r != 0)
+			continue;
+
+		// an identical video (a copy or a link) shares the search of the first one
+		for (int k = 0; k < i && !ctx->options.name_search_only; k++) {
+			if (b->jobs[k].r == 0 && !b->jobs[k].same_as &&
+			    b->jobs[k].hash == b->jobs[i].hash && b->jobs[k].filesize == b->jobs[i].filesize &&
+			    strcmp(b->jobs[k].lang, b->jobs[i].lang) == 0) {
+				b->jobs[i].same_as = k + 1;
+				break;
+			}
+		}
+		if (b->jobs[i].same_as) {
+			ctx->stats.duplicates++;
+			continue;
+		}
+
+		if (ctx->index_map && !ctx->options.name_search_only && index_lookup(ctx, &b->jobs[i])) {
+			log_info("found %s in the index.", b->jobs[i].filename);
+			ctx->stats.index_hits++;
+			continue;
+		}
+
+		log_info("searching for %s...", b->jobs[i].filename);
+		if (ctx->search_cache_dir && search_cache_lookup(ctx, &b->jobs[i]))
+			ctx->stats.search_cache_hits++;
+		// or share the search of one in an earlier batch
+		else if (seen_lookup(ctx, &b->jobs[i]))
+			ctx->stats.duplicates++;
+	}
+
+	search_start(ctx, &b->search, b->jobs, b->n);
+}
+
+static void batch_finish_search(struct sth_context *ctx, struct batch *b) {
+	b->r = b->search.call.r;
+	if (b->r != 0)
+		return;
+
+	for (int i = 0; i < b->n; i++) {
+		struct sth_file *job = &b->jobs[i];
+		if (job->r != 0 || !job->same_as)
+			continue;
+
+		const struct sth_file *first = &b->jobs[job->same_as - 1];
+		if (first->r != 0 || !first->searched) {
+			job->r = first->r ? first->r : 1;
+			continue;
+		}
+
+		job->sub_infos = arena_alloc(job->arena, first->sub_count * sizeof(struct sth_sub_info) + 1);
+		if (!job->sub_infos) {
+			job->r = log_oom();
+			continue;
+		}
+		memcpy(job->sub_infos, first->sub_infos, first->sub_count * sizeof(struct sth_sub_info));
+		job->sub_count = job->sub_capacity = first->sub_count;
+		job->searched = true;
+		job->search_cached = first->search_cached;
+		job->indexed = first->indexed;
+	}
+
+	for (int i = 0; i < b->n; i++) {
+		const struct sth_file *job = &b->jobs[i];
+		if (job->r != 0 || !job->searched || job->same_as || job->seen)
+			continue;
+
+		seen_store(ctx, job);
+		if (ctx->search_cache_dir && !job->search_cached && !job->indexed)
+			search_cache_store(ctx, job);
+	}
+}
+
+const char *sth_file_path(const struct sth_file *file) {
+	return file->filepath;
+}
+
+bool sth_file_hash(const struct sth_file *file, uint64_t *hash, uint64_t *size) {
+	*hash = file->hash;
+	*size = file->filesize;
+	return file->hashed;
+}
+
+int sth_file_error(const struct sth_file *file) {
+	return file->r;
+}
+
+void *sth_file_data(const struct sth_file *file) {
+	return file->data;
+}
+
+struct sth_sub_info *sth_file_results(struct sth_file *file, int *count) {
+	*count = file->sub_count;
+	return file->sub_infos;
+}
+
+int sth_file_choose(struct sth_file *file, const struct sth_sub_info *sub, const char *path) {
+	struct batch *b = file->batch;
+
+	struct sub_download *dl = sub_download_add(&b->chosen);
+	if (!dl)
+		return log_oom();
+
+	dl->id = sub->id;
+	dl->source = sub->local_path;
+	dl->encoding = sub->encoding;
+	dl->job = file - b->jobs;
+	dl->filepath = strdup(path);
+	if (!dl->filepath) {
+		b->chosen.count--;
+		return log_oom();
+	}
+
+	return 0;
+}
+
+int sth_file_download(struct sth_file *file, const struct sth_sub_info *sub, const char *path) {
+	struct batch *b = file->batch;
+	struct sub_download *total = &b->dls[file - b->jobs];
+	struct sub_download now = {
+		.id = sub->id,
+		.filepath = path,
+		.source = sub->local_path,
+		.encoding = sub->encoding,
+	};
+
+	sub_download(b->ctx, &now, 1);
+	total->download_seconds += now.download_seconds;
+	total->decode_seconds += now.decode_seconds;
+	total->bytes_written += now.bytes_written;
+	return now.r;
+}
+
+/*
+ * ranks the results of the files and calls back to choose among them,
+ * returns false if processing has to stop.
+ */
+static bool batch_choose(struct sth_context *ctx, struct batch *b, const struct sth_callbacks *callbacks) {
+	bool go_on = true;
+
+	for (; b->processed < b->n; b->processed++) {
+		struct sth_file *job = &b->jobs[b->processed];
+		if (job->r == 0)
+			job->r = b->r;
+		if (job->r == 0)
+			sth_rank(job->filepath, job->sub_infos, job->sub_count);
+
+		int r = callbacks->choose(ctx, job, callbacks->data);
+		if (job->r == 0)
+			job->r = r;
+
+		if (job->r != 0 && ctx->options.exit_on_fail) {
+			b->processed++;
+			go_on = false;
+			break;
+		}
+	}
+
+	if (callbacks->batch_done && callbacks->batch_done(ctx, callbacks->data) != 0)
+		return false;
+
+	return go_on;
+}
+
+/*
+ * starts downloading everything that was chosen without asking.
+ */
+static void batch_start_download(struct sth_context *ctx, struct batch *b) {
+	if (b->chosen.count > 0)
+		sub_download_start(ctx, b->chosen.dls, b->chosen.count, &b->downloads);
+}
+
+static int batch_finish_download(struct sth_context *ctx, struct batch *b, const struct sth_callbacks *callbacks) {
+	int r = 0;
+
+	if (b->chosen.count > 0) {
+		sub_download_finish(b->downloads, b->chosen.dls, b->chosen.count);
+		b->downloads = NULL;
+	}
+
+	// a file fails with the first of its subtitles that failed
+	for (int i = 0; i < b->chosen.count; i++) {
+		const struct sub_download *dl = &b->chosen.dls[i];
+		struct sub_download *total = &b->dls[dl->job];
+		total->download_seconds += dl->download_seconds;
+		total->decode_seconds += dl->decode_seconds;
+		total->bytes_written += dl->bytes_written;
+		if (dl->r != 0 && b->jobs[dl->job].r == 0)
+			b->jobs[dl->job].r = dl->r;
+	}
+
+	for (int i = 0; i < b->processed; i++) {
+		stats_add_file(ctx, &b->jobs[i], &b->dls[i]);
+		if (callbacks->file_done)
+			callbacks->file_done(ctx, &b->jobs[i], callbacks->data);
+	}
+
+	if (b->r != 0)
+		return b->r;
+
+	for (int i = 0; i < b->processed; i++) {
+		if (b->jobs[i].r != 0) {
+			r = b->jobs[i].r;
+			if (ctx->options.exit_on_fail)
+				break;
+		}
+	}
+
+	return r;
+}
+
+/*
+ * while the subtitles of one batch are downloaded and decompressed, the next
+ * batch is already searched for.
+ */
+int sth_process_files(struct sth_context *ctx, char **filepaths, int count, const struct sth_callbacks *callbacks) {
+	struct batch *cur = NULL;
+	struct batch *next = NULL;
+	int pos = 0;
+	int r = 0;
+
+	if (count == 0)
+		return 0;
+
+	cur = batch_new(ctx, filepaths, count < ctx->options.batch_size ? count : ctx->options.batch_size);
+	if (!cur)
+		return log_oom();
+	pos += cur->n;
+
+	batch_start_search(ctx, cur);
+	rpc_finish(ctx);
+	batch_finish_search(ctx, cur);
+
+	while (cur) {
+		bool go_on = batch_choose(ctx, cur, callbacks);
+
+		batch_start_download(ctx, cur);
+
+		next = NULL;
+		if (go_on && pos < count) {
+			next = batch_new(ctx, &filepaths[pos], count - pos < ctx->options.batch_size ? count - pos : ctx->options.batch_size);
+			if (!next) {
+				r = log_oom();
+				go_on = false;
+			} else {
+				pos += next->n;
+				batch_start_search(ctx, next);
+			}
+		}
+
+		rpc_finish(ctx);
+
+		if (next)
+			batch_finish_search(ctx, next);
+
+		int batch_r = batch_finish_download(ctx, cur, callbacks);
+		batch_free(cur);
+		cur = next;
+
+		if (batch_r != 0)
+			r = batch_r;
+		if ((batch_r != 0 && ctx->options.exit_on_fail) || !go_on)
+			break;
+	}
+
+	batch_free(cur);
+	seen_free(ctx);
+
+	return r;
+}
+
+/*
+ * a single batch, so that identical queries share a single query of the
+ * SearchSubtitles call.
+ */
+int sth_process_queries(struct sth_context *ctx, const struct sth_query *queries, int count,
+                        const struct sth_callbacks *callbacks) {
+	char *filepaths[count > 0 ? count : 1];
+
+	if (count == 0)
+		return 0;
+
+	for (int i = 0; i < count; i++)
+		filepaths[i] = (char *) queries[i].path;
+
+	struct batch *b = batch_new(ctx, filepaths, count);
+	if (!b)
+		return log_oom();
+
+	for (int i = 0; i < count; i++) {
+		struct sth_file *job = &b->jobs[i];
+		if (queries[i].lang)
+			job->lang = queries[i].lang;
+		job->data = queries[i].data;
+		if (queries[i].hashed) {
+			job->hash = queries[i].hash;
+			job->filesize = queries[i].size;
+			job->hashed = true;
+		}
+	}
+
+	batch_start_search(ctx, b);
+	rpc_finish(ctx);
+	batch_finish_search(ctx, b);
+
+	batch_choose(ctx, b, callbacks);
+	batch_start_download(ctx, b);
+	rpc_finish(ctx);
+
+	int r = batch_finish_download(ctx, b, callbacks);
+	batch_free(b);
+	seen_free(ctx);
+	return r;
+}
+
+static const char *string_copy(char **p, const char *s) {
+	size_t len = strlen(s) + 1;
+	const char *copy = memcpy(*p, s, len);
+	*p += len;
+	return copy;
+}
+
+/*
+ * copies the results to a single allocation, the array followed by the strings.
+ */
+static int sub_infos_copy(const struct sth_sub_info *sub_infos, int n, struct sth_sub_info **copy) {
+	size_t size = n * sizeof(struct sth_sub_info);
+	for (int i = 0; i < n; i++) {
+		size += strlen(sub_infos[i].lang) + strlen(sub_infos[i].release_name) +
+		        strlen(sub_infos[i].filename) + strlen(sub_infos[i].encoding) + 4;
+		if (sub_infos[i].local_path)
+			size += strlen(sub_infos[i].local_path) + 1;
+	}
+
+	*copy = malloc(size ? size : 1);
+	if (!*copy)
+		return log_oom();
+
+	char *p = (char *) (*copy + n);
+	for (int i = 0; i < n; i++) {
+		struct sth_sub_info *sub_info = &(*copy)[i];
+		*sub_info = sub_infos[i];
+		sub_info->lang = string_copy(&p, sub_infos[i].lang);
+		sub_info->release_name = string_copy(&p, sub_infos[i].release_name);
+		sub_info->filename = string_copy(&p, sub_infos[i].filename);
+		sub_info->encoding = string_copy(&p, sub_infos[i].encoding);
+		if (sub_infos[i].local_path)
+			sub_info->local_path = string_copy(&p, sub_infos[i].local_path);
+	}
+
+	return 0;
+}
+
+/*
+ * a batch of a single file, which is searched for right away.
+ */
+int sth_search(struct sth_context *ctx, const char *path, struct sth_sub_info **subs, int *count) {
+	char *paths[] = { (char *) path };
+
+	*subs = NULL;
+	*count = 0;
+
+	struct batch *b = batch_new(ctx, paths, 1);
+	if (!b)
+		return log_oom();
+
+	batch_start_search(ctx, b);
+	rpc_finish(ctx);
+	batch_finish_search(ctx, b);
+
+	struct sth_file *job = &b->jobs[0];
+	if (job->r == 0)
+		job->r = b->r;
+	if (job->r == 0) {
+		sth_rank(job->filepath, job->sub_infos, job->sub_count);
+		job->r = sub_infos_copy(job->sub_infos, job->sub_count, subs);
+	}
+	if (job->r == 0)
+		*count = job->sub_count;
+
+	stats_add_file(ctx, job, &b->dls[0]);
+
+	int r = job->r;
+	batch_free(b);
+	return r;
+}
+
+int sth_select(const struct sth_sub_info *subs, int count, int min_score) {
+	if (min_score <= 0)
+		return count > 0 ? 0 : -1;
+
+	// like before the ranking, a hash match is taken over a better ranked name match
+	for (int i = 0; i < count && min_score <= SCORE_HASH; i++) {
+		if (subs[i].matched_by_hash)
+			return i;
+	}
+	for (int i = 0; i < count; i++) {
+		if (subs[i].score >= min_score)
+			return i;
+	}
+	return -1;
+}
+
+int sth_download(struct sth_context *ctx, const struct sth_sub_info *sub, const struct sth_sink *sink) {
+	struct sub_download dl = {
+		.id = sub->id,
+		.sink = sink,
+		.source = sub->local_path,
+		.encoding = sub->encoding,
+	};
+
+	sub_download(ctx, &dl, 1);
+	return dl.r;
+}
+
+int sth_download_file(struct sth_context *ctx, const struct sth_sub_info *sub, const char *path) {
+	struct sub_download dl = {
+		.id = sub->id,
+		.filepath = path,
+		.source = sub->local_path,
+		.encoding = sub->encoding,
+	};
+
+	sub_download(ctx, &dl, 1);
+	return dl.r;
+}
+
+int sth_list_languages(struct sth_context *ctx,
+                       void (*callback)(const char *id, const char *name, void *data), void *data) {
+	_cleanup_env_ xmlrpc_env env;
+	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;
+	_cleanup_xmlrpc_ xmlrpc_value *languages = NULL;
+
+	xmlrpc_env_init(&env);
+
+	rate_acquire(ctx);
+	xmlrpc_client_call2f(&env, ctx->client, ctx->options.server_url, "GetSubLanguages", &result, "()");
+	if (env.fault_occurred) {
+		log_err("failed to download languages: %s (%d)", env.fault_string, env.fault_code);
+		return env.fault_code;
+	}
+
+	xmlrpc_struct_read_value(&env, result, "data", &languages);
+	if (env.fault_occurred) {
+		log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
+		return env.fault_code;
+	}
+
+	int n = xmlrpc_array_size(&env, languages);
+	if (env.fault_occurred) {
+		log_err("failed to get array size: %s (%d)", env.fault_string, env.fault_code);
+		return env.fault_code;
+	}
+
+	for (int i = 0; i < n; i++) {
+		_cleanup_xmlrpc_ xmlrpc_value *language = NULL;
+		xmlrpc_array_read_item(&env, languages, i, &language);
+
+		_cleanup_free_ const char *lang_id = struct_get_string(&env, language, "SubLanguageID");
+		_cleanup_free_ const char *lang_name = struct_get_string(&env, language, "LanguageName");
+		if (env.fault_occurred) {
+			log_err("invalid language: %s (%d)", env.fault_string, env.fault_code);
+			return env.fault_code;
+		}
+
+		callback(lang_id, lang_name, data);
+	}
+
+	return 0;
+}
+
+int sth_hash(const char *path, uint64_t *hash, uint64_t *size) {
+	_cleanup_close_ int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		int r = errno;
+		log_err("failed to open %s: %s", path, strerror(r));
+		return r;
+	}
+
+	struct stat st;
+	int r = get_hash_and_filesize(fd, hash, size, &st);
+	if (r != 0)
+		log_err("failed to read %s: %s", path, strerror(r));
+	return r;
+}
+
+int sth_global_init(void) {
+	_cleanup_env_ xmlrpc_env env;
+
+	xmlrpc_env_init(&env);
+	xmlrpc_client_setup_global_const(&env);
+	if (env.fault_occurred) {
+		log_err("failed to init xmlrpc-c: %s (%d)", env.fault_string, env.fault_code);
+		return env.fault_code;
+	}
+
+	// make sure the library doesn't complain about too much data
+	xmlrpc_limit_set(XMLRPC_XML_SIZE_LIMIT_ID, STH_XMLRPC_SIZE_LIMIT);
+	return 0;
+}
+
+void sth_global_cleanup(void) {
+	xmlrpc_client_teardown_global_const();
+}
+
+void sth_options_init(struct sth_options *options) {
+	*options = (struct sth_options) {
+		.server_url = STH_XMLRPC_URL,
+		.lang = "eng",
+		.limit = 10,
+		.batch_size = 1,
+		.exit_on_fail = true,
+		.hash_threads = 4,
+		.use_hash_cache = true,
+		.use_search_cache = true,
+		.search_cache_ttl = 24 * 60 * 60,
+		.max_inflight = 4,
+		.rate_limit = RATE_LIMIT_REQUESTS,
+		.timeout = 60,
+		.connect_timeout = 10,
+	};
+}
+
+int sth_new(const struct sth_options *options, struct sth_context **ctx_out) {
+	_cleanup_env_ xmlrpc_env env;
+	int r;
+
+	*ctx_out = NULL;
+
+	struct sth_context *ctx = calloc(1, sizeof(struct sth_context));
+	if (!ctx)
+		return log_oom();
+
+	ctx->hash_cache_fd = -1;
+	ctx->options = *options;
+	ctx->options.server_url = strdup(options->server_url);
+	ctx->options.lang = strdup(options->lang);
+	ctx->options.index_path = options->index_path ? strdup(options->index_path) : NULL;
+	if (!ctx->options.server_url || !ctx->options.lang || (options->index_path && !ctx->options.index_path)) {
+		sth_free(ctx);
+		return log_oom();
+	}
+
+	ctx->stats.started = stats_now();
+	uint64_t seed = (uint64_t) time(NULL) ^ (uint64_t) getpid() ^ (uintptr_t) ctx;
+	ctx->rand_state[0] = seed;
+	ctx->rand_state[1] = seed >> 16;
+	ctx->rand_state[2] = seed >> 32;
+	rate_init(ctx);
+
+	xmlrpc_env_init(&env);
+
+	// the client keeps its connection between calls, keep it alive while idle
+	struct xmlrpc_curl_xportparms curl_parms = {
+		.timeout = ctx->options.timeout * 1000,
+		.connect_timeout = ctx->options.connect_timeout * 1000,
+		.tcp_keepalive = true,
+	};
+	struct xmlrpc_clientparms client_parms = {
+		.transport = "curl",
+		.transportparmsP = &curl_parms,
+		.transportparm_size = XMLRPC_CXPSIZE(tcp_keepalive),
+	};
+
+	xmlrpc_client_create(&env, XMLRPC_CLIENT_NO_FLAGS, "subberthehut", VERSION,
+	                     &client_parms, XMLRPC_CPSIZE(transportparm_size), &ctx->client);
+	if (env.fault_occurred) {
+		log_err("failed to init xmlrpc client: %s (%d)", env.fault_string, env.fault_code);
+		r = env.fault_code;
+		sth_free(ctx);
+		return r;
+	}
+
+	r = transport_init(ctx);
+	if (r != 0) {
+		sth_free(ctx);
+		return log_oom();
+	}
+
+	if (ctx->options.use_hash_cache) {
+		r = hash_cache_open(ctx);
+		if (r != 0) {
+			log_err("warning: failed to open the hash cache: %s", strerror(r));
+			hash_cache_close(ctx);
+		}
+	}
+
+	if (ctx->options.use_search_cache && ctx->options.search_cache_ttl > 0) {
+		r = search_cache_open(ctx);
+		if (r != 0) {
+			log_err("warning: failed to open the search cache: %s", strerror(r));
+			search_cache_close(ctx);
+		}
+	}
+
+	if (ctx->options.use_blob_store) {
+		r = blob_store_open(ctx);
+		if (r != 0) {
+			log_err("warning: failed to open the blob store: %s", strerror(r));
+			blob_store_close(ctx);
+		}
+	}
+
+	if (ctx->options.index_path) {
+		r = index_open(ctx, ctx->options.index_path);
+		if (r != 0)
+			log_err("warning: failed to open the index in %s: %s", ctx->options.index_path, strerror(r));
+	}
+
+	ctx->server_info = xmlrpc_server_info_new(&env, ctx->options.server_url);
+	if (env.fault_occurred) {
+		log_err("failed to init xmlrpc client: %s (%d)", env.fault_string, env.fault_code);
+		r = env.fault_code;
+		sth_free(ctx);
+		return r;
+	}
+
+	// reuse the token of a previous run, the login is done when needed
+	session_open(ctx);
+
+	*ctx_out = ctx;
+	return 0;
+}
+
+void sth_free(struct sth_context *ctx) {
+	if (!ctx)
+		return;
+
+	session_close(ctx);
+	hash_cache_close(ctx);
+	search_cache_close(ctx);
+	index_close(ctx);
+	blob_store_close(ctx);
+	seen_free(ctx);
+	stats_free(ctx);
+	if (ctx->server_info)
+		xmlrpc_server_info_free(ctx->server_info);
+	transport_free(ctx);
+	if (ctx->client)
+		xmlrpc_client_destroy(ctx->client);
+	free((void *) ctx->options.server_url);
+	free((void *) ctx->options.lang);
+	free((void *) ctx->options.index_path);
+	free(ctx);
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright 2015 Marius Thesing
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * libsubberthehut: the core of subberthehut, for programs which look up
+ * subtitles for many files over a long time. A context keeps the client, the
+ * session token and the caches, so only the first call pays for logging in.
+ *
+ * Functions returning int return 0 on success, or an errno value (or a fault
+ * code of xmlrpc-c) on failure; the details are logged, see sth_set_log().
+ * A context must only be used by one thread at a time, but each thread may
+ * have a context of its own.
+ */
+
+#ifndef LIBSUBBERTHEHUT_H
+#define LIBSUBBERTHEHUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STH_XMLRPC_URL "https://api.opensubtitles.org/xml-rpc"
+
+// the score every hash match reaches, see sth_rank()
+#define STH_SCORE_HASH 50
+
+struct sth_context;
+
+/*
+ * a file of sth_process_files(), valid during its choose() callback.
+ */
+struct sth_file;
+
+/*
+ * initialize with sth_options_init(), which sets the defaults of subberthehut.
+ * The strings are copied by sth_new().
+ */
+struct sth_options {
+	const char *server_url;
+	const char *lang;            // comma-separated, or "all"
+	int limit;                   // of the results per file
+	bool hash_search_only;
+	bool name_search_only;
+	bool force_overwrite;        // of existing subtitles, instead of failing
+	bool utf8;                   // convert subtitles to UTF-8
+	bool unix_newlines;
+	bool strip_bom;
+	int batch_size;              // files per search of sth_process_files()
+	bool exit_on_fail;           // sth_process_files() stops at the first failed file
+	int hash_threads;
+	bool use_hash_cache;
+	bool use_search_cache;
+	int search_cache_ttl;        // in seconds, 0 disables the search cache
+	bool use_blob_store;
+	const char *index_path;      // of a local mirror, NULL for none
+	int max_inflight;
+	int rate_limit;              // requests per 10 seconds
+	int timeout;                 // in seconds
+	int connect_timeout;         // in seconds
+	bool http2;
+	bool stats;                  // keep the per-file numbers for sth_stats_write()
+};
+
+/*
+ * a search result. The strings are owned by whatever returned it.
+ */
+struct sth_sub_info {
+	const char *lang;
+	const char *release_name;
+	const char *filename;
+	const char *encoding;   // according to the server, "" if unknown
+	const char *local_path; // NULL, or a subtitle of the index relative to its directory
+	int id;
+	float fps;            // 0 if unknown
+	float rating;         // 0 to 10, 0 if not rated
+	int downloads;
+	int score;            // see sth_rank()
+	unsigned char uploader_rank; // 0 to 2
+	bool matched_by_hash;
+	bool bad;
+};
+
+/*
+ * receives a subtitle a chunk at a time, instead of a file. A non-zero
+ * return of write() aborts the download and is returned by it.
+ */
+struct sth_sink {
+	int (*write)(void *data, const void *buf, size_t len);
+	void *data;
+};
+
+/*
+ * choose() is called by sth_process_files() for every file once it was
+ * searched for, in the order they were passed, even if that failed (see
+ * sth_file_error()). It picks subtitles with sth_file_choose() or
+ * sth_file_download(); a non-zero return makes the file fail.
+ * batch_done() is optional, it is called once the files of a batch were
+ * chosen; a non-zero return stops processing.
+ * file_done() is optional, it is called for every file choose() was called
+ * for once its subtitles were downloaded; sth_file_error() tells if the file
+ * failed.
+ */
+struct sth_callbacks {
+	int (*choose)(struct sth_context *ctx, struct sth_file *file, void *data);
+	int (*batch_done)(struct sth_context *ctx, void *data);
+	void (*file_done)(struct sth_context *ctx, struct sth_file *file, void *data);
+	void *data;
+};
+
+/*
+ * a video for sth_process_queries(). If hashed is set, the video isn't read
+ * and path only needs to name it, for the name-based search.
+ */
+struct sth_query {
+	const char *path;
+	const char *lang;   // NULL for the languages of the options
+	uint64_t hash;
+	uint64_t size;
+	bool hashed;
+	void *data;         // see sth_file_data()
+};
+
+enum sth_log_level {
+	STH_LOG_ERR,  // errors and warnings
+	STH_LOG_INFO, // progress
+};
+
+/*
+ * process wide: sth_global_init() must be called before the first context is
+ * created, and sth_global_cleanup() after the last one was freed.
+ */
+int sth_global_init(void);
+void sth_global_cleanup(void);
+
+/*
+ * sends the messages to log. Without it, errors are written to stderr and
+ * progress isn't written at all. Process wide, set it before creating a
+ * context. log may be called from the threads hashing files, but never by
+ * two threads at the same time.
+ */
+void sth_set_log(void (*log)(enum sth_log_level level, const char *message, void *data), void *data);
+
+void sth_options_init(struct sth_options *options);
+
+/*
+ * creates a context: the client, and the caches enabled by the options. The
+ * token of an earlier session is reused, the login is done when needed.
+ */
+int sth_new(const struct sth_options *options, struct sth_context **ctx);
+void sth_free(struct sth_context *ctx);
+
+/*
+ * the hash OpenSubtitles.org identifies a video by, and its size.
+ */
+int sth_hash(const char *path, uint64_t *hash, uint64_t *size);
+
+/*
+ * searches for the subtitles of the video at path. *subs is a single
+ * allocation, free() it; the results are ranked, best first.
+ */
+int sth_search(struct sth_context *ctx, const char *path, struct sth_sub_info **subs, int *count);
+
+/*
+ * scores the results from 0 to 100 by how likely they fit the video and how
+ * good they are, and sorts them best first.
+ */
+void sth_rank(const char *path, struct sth_sub_info *subs, int count);
+
+/*
+ * the index of the result to take without asking, or -1: the best ranked
+ * hash match if min_score is at most STH_SCORE_HASH (even if a name match
+ * ranks higher, or it was reported as bad), otherwise the best ranked result
+ * which scores at least min_score. A min_score of 0 takes the best ranked
+ * result. subs must be ranked.
+ */
+int sth_select(const struct sth_sub_info *subs, int count, int min_score);
+
+/*
+ * downloads a subtitle (or copies it from the index or the blob store) to
+ * a sink, or to the file at path.
+ */
+int sth_download(struct sth_context *ctx, const struct sth_sub_info *sub, const struct sth_sink *sink);
+int sth_download_file(struct sth_context *ctx, const struct sth_sub_info *sub, const char *path);
+
+/*
+ * searches for the subtitles of many files, batch_size per request, calling
+ * back to choose among them. While the subtitles of one batch are
+ * downloaded, the next batch is already searched for.
+ */
+int sth_process_files(struct sth_context *ctx, char **paths, int count, const struct sth_callbacks *callbacks);
+
+/*
+ * like sth_process_files(), but all queries are searched for with a single
+ * request, in which queries for the same video and languages are coalesced.
+ */
+int sth_process_queries(struct sth_context *ctx, const struct sth_query *queries, int count,
+                        const struct sth_callbacks *callbacks);
+
+const char *sth_file_path(const struct sth_file *file);
+// returns false if the file wasn't hashed, e.g. with name_search_only
+bool sth_file_hash(const struct sth_file *file, uint64_t *hash, uint64_t *size);
+// non-zero if hashing, searching or, in file_done(), downloading failed
+int sth_file_error(const struct sth_file *file);
+// the data of its sth_query, NULL for sth_process_files()
+void *sth_file_data(const struct sth_file *file);
+// the results, ranked, valid until choose() returns
+struct sth_sub_info *sth_file_results(struct sth_file *file, int *count);
+
+/*
+ * downloads sub to path together with the subtitles chosen for the other
+ * files of the batch. sub must be one of the results of the file.
+ */
+int sth_file_choose(struct sth_file *file, const struct sth_sub_info *sub, const char *path);
+
+/*
+ * downloads sub to path right away, e.g. when the user is asked for the next one.
+ */
+int sth_file_download(struct sth_file *file, const struct sth_sub_info *sub, const char *path);
+
+int sth_list_languages(struct sth_context *ctx,
+                       void (*callback)(const char *id, const char *name, void *data), void *data);
+
+/*
+ * builds the index of a local mirror from dir/manifest.tsv, see --build-index.
+ */
+int sth_build_index(const char *dir);
+
+/*
+ * writes the numbers collected by the context to path, as JSON, or in the
+ * Prometheus textfile format if path ends in .prom.
+ */
+int sth_stats_write(struct sth_context *ctx, const char *path);
+
+#endif
@@ -19,28 +19,47 @@
 #define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <inttypes.h> // uint64_t / PRIx64
-
-#include <xmlrpc-c/base.h>
-#include <xmlrpc-c/client.h>
-#include <glib.h> // g_base64_decode_step
-#include <zlib.h>
-
-#define STH_XMLRPC_URL         "https://api.opensubtitles.org/xml-rpc"
-#define LOGIN_LANGCODE         "en"
-#define LOGIN_USER_AGENT       "subberthehut v" VERSION
-
-#define ZLIB_CHUNK             (64 * 1024)
-
-#define STH_XMLRPC_SIZE_LIMIT  (10 * 1024 * 1024)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libsubberthehut.h"
+
+// --watch: time a new file must stay untouched before it is processed
+#define WATCH_DEBOUNCE_MS      3000
+
+// --serve: the most clients connected at once, the largest request, and the
+// most requests searched for with a single request to the server
+#define SERVE_CLIENTS_MAX      64
+#define SERVE_REQUEST_MAX      (64 * 1024)
+#define SERVE_BATCH_MAX        20
+
+// files considered by --recursive, and the subtitles that make them be skipped
+static const char *const video_extensions[] = {
+	"3gp", "asf", "avi", "divx", "flv", "m2ts", "m4v", "mkv", "mov", "mp4",
+	"mpeg", "mpg", "mts", "ogm", "ogv", "rm", "rmvb", "ts", "vob", "webm", "wmv", NULL
+};
+static const char *const sub_extensions[] = {
+	"ass", "idx", "smi", "srt", "ssa", "sub", "txt", "vtt", NULL
+};
 
 #define HEADER_ID              '#'
 #define HEADER_MATCHED_BY_HASH 'H'
+#define HEADER_SCORE           "Scr"
 #define HEADER_LANG            "Lng"
 #define HEADER_RELEASE_NAME    "Release / File Name"
 
@@ -51,47 +70,27 @@
 
 /* __attribute__(cleanup) */
 #define _cleanup_free_    __attribute__((cleanup(cleanup_free)))
-#define _cleanup_fclose_  __attribute__((cleanup(cleanup_fclose)))
-#define _cleanup_xmlrpc_  __attribute__((cleanup(cleanup_xmlrpc_DECREF)))
 
 static void cleanup_free(void *p) {
 	free(*(void**)p);
 }
-
-static void cleanup_fclose(FILE **p) {
-	if(*p)
-		fclose(*p);
-}
-
-static void cleanup_xmlrpc_DECREF(xmlrpc_value **p) {
-	if(*p)
-		xmlrpc_DECREF(*p);
-}
 /* end __attribute__(cleanup) */
 
-static xmlrpc_env env;
-static xmlrpc_client *client;
-
-// options default values
-static const char *lang = "eng";
+// options default values, see also sth_options_init()
+static struct sth_options options;
 static bool list_languages = false;
-static bool force_overwrite = false;
 static bool always_ask = false;
 static bool never_ask = false;
-static bool hash_search_only = false;
-static bool name_search_only = false;
 static bool same_name = false;
-static int limit = 10;
-static bool exit_on_fail = true;
+static bool per_language = false;
+static bool ndjson = false;
+static bool recursive = false;
+static bool watch = false;
+static int min_score = STH_SCORE_HASH;
 static unsigned int quiet = 0;
-
-struct sub_info {
-	int id;
-	bool matched_by_hash;
-	const char *lang;
-	const char *release_name;
-	const char *filename;
-};
+static const char *stats_path = NULL;
+static const char *build_index_path = NULL;
+static const char *serve_path = NULL;
 
 static void log_err(const char *format, ...) {
 	va_list args;
@@ -105,11 +104,14 @@ static void log_info(const char *format, ...) {
 	if (quiet >= 2)
 		return;
 
+	// stdout is reserved for the records of --ndjson
+	FILE *f = ndjson ? stderr : stdout;
+
 	va_list args;
 	va_start(args, format);
-	vprintf(format, args);
+	vfprintf(f, format, args);
 	va_end(args);
-	putchar('\n');
+	putc('\n', f);
 }
 
 static int log_oom() {
@@ -118,131 +120,27 @@ static int log_oom() {
 }
 
 /*
- * creates the 64-bit hash used for the search query.
- * copied and modified from:
- * http://trac.opensubtitles.org/projects/opensubtitles/wiki/HashSourceCodes
+ * the messages of the library, printed like those of the command line.
  */
-static void get_hash_and_filesize(FILE *handle, uint64_t *hash, uint64_t *filesize) {
-	fseek(handle, 0, SEEK_END);
-	*filesize = ftell(handle);
-	fseek(handle, 0, SEEK_SET);
-
-	*hash = *filesize;
-
-	for (uint64_t tmp = 0, i = 0; i < 65536 / sizeof(tmp) && fread((char *) &tmp, sizeof(tmp), 1, handle); *hash += tmp, i++);
-	fseek(handle, (*filesize - 65536) > 0 ? (*filesize - 65536) : 0, SEEK_SET);
-	for (uint64_t tmp = 0, i = 0; i < 65536 / sizeof(tmp) && fread((char *) &tmp, sizeof(tmp), 1, handle); *hash += tmp, i++);
-}
-
-/*
- * convenience function the get a string value from a xmlrpc struct.
- */
-static const char *struct_get_string(xmlrpc_value *s, const char *key) {
-	_cleanup_xmlrpc_ xmlrpc_value *xmlval = NULL;
-	const char *str;
-
-	xmlrpc_struct_find_value(&env, s, key, &xmlval);
-	xmlrpc_read_string(&env, xmlval, &str);
-
-	return str;
-}
-
-static int login(const char **token) {
-	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *token_xmlval = NULL;
-	_cleanup_free_ const char *status = NULL;
-
-	xmlrpc_client_call2f(&env, client, STH_XMLRPC_URL, "LogIn", &result, "(ssss)", "", "", LOGIN_LANGCODE, LOGIN_USER_AGENT);
-	if (env.fault_occurred) {
-		log_err("login failed: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
-	}
-
-	status = struct_get_string(result, "status");
-	if (strcmp(status, "200 OK")) {
-		log_err("login failed: %s", status);
-		return 1;
-	}
-
-	xmlrpc_struct_find_value(&env, result, "token", &token_xmlval);
-	xmlrpc_read_string(&env, token_xmlval, token);
+static void log_message(enum sth_log_level level, const char *message, void *data) {
+	(void) data;
 
-	return 0;
+	if (level == STH_LOG_ERR)
+		log_err("%s", message);
+	else
+		log_info("%s", message);
 }
 
-static int search_get_results(const char *token, uint64_t hash, uint64_t filesize,
-                              const char *filename, xmlrpc_value **data) {
-	_cleanup_xmlrpc_ xmlrpc_value *hash_query = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *sublanguageid_xmlval = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *hash_xmlval = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *filesize_xmlval = NULL;
-	_cleanup_free_ char *hash_str = NULL;
-	_cleanup_free_ char *filesize_str = NULL;
-
-	_cleanup_xmlrpc_ xmlrpc_value *name_query = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *filename_xmlval = NULL;
-
-	_cleanup_xmlrpc_ xmlrpc_value *query_array = NULL;
-
-	_cleanup_xmlrpc_ xmlrpc_value *limit_xmlval = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *param_struct = NULL;
-
-	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;
-
-	query_array = xmlrpc_array_new(&env);
-
-	// create hash-based query
-	if (!name_search_only) {
-		hash_query = xmlrpc_struct_new(&env);
-		sublanguageid_xmlval = xmlrpc_string_new(&env, lang);
-		xmlrpc_struct_set_value(&env, hash_query, "sublanguageid", sublanguageid_xmlval);
-		int r = asprintf(&hash_str, "%016" PRIx64, hash);
+static int write_full(int fd, const unsigned char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t r = write(fd, buf, len);
+		if (r == -1 && errno == EINTR)
+			continue;
 		if (r == -1)
-			return log_oom();
-
-		hash_xmlval = xmlrpc_string_new(&env, hash_str);
-		xmlrpc_struct_set_value(&env, hash_query, "moviehash", hash_xmlval);
-
-		r = asprintf(&filesize_str, "%" PRIu64, filesize);
-		if (r == -1)
-			return log_oom();
-
-		filesize_xmlval = xmlrpc_string_new(&env, filesize_str);
-		xmlrpc_struct_set_value(&env, hash_query, "moviebytesize", filesize_xmlval);
-
-		xmlrpc_array_append_item(&env, query_array, hash_query);
-	}
-
-	// create full-text query
-	if (!hash_search_only) {
-		name_query = xmlrpc_struct_new(&env);
-
-		sublanguageid_xmlval = xmlrpc_string_new(&env, lang);
-		xmlrpc_struct_set_value(&env, name_query, "sublanguageid", sublanguageid_xmlval);
-
-		filename_xmlval = xmlrpc_string_new(&env, filename);
-		xmlrpc_struct_set_value(&env, name_query, "query", filename_xmlval);
-
-		xmlrpc_array_append_item(&env, query_array, name_query);
-	}
-
-	// create parameter structure (currently only for "limit")
-	param_struct = xmlrpc_struct_new(&env);
-	limit_xmlval = xmlrpc_int_new(&env, limit);
-	xmlrpc_struct_set_value(&env, param_struct, "limit", limit_xmlval);
-
-	xmlrpc_client_call2f(&env, client, STH_XMLRPC_URL, "SearchSubtitles", &result, "(sAS)", token, query_array, param_struct);
-	if (env.fault_occurred) {
-		log_err("query failed: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
-	}
-
-	xmlrpc_struct_read_value(&env, result, "data", data);
-	if (env.fault_occurred) {
-		log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+			return errno;
+		buf += r;
+		len -= r;
 	}
-
 	return 0;
 }
 
@@ -250,7 +148,8 @@ static void print_separator(int c, int digit_count) {
 	for (int i = 0; i < c; i++) {
 		if (i == digit_count + 1 ||
 		    i == digit_count + 1 + 4 ||
-		    i == digit_count + 1 + 4 + 6) {
+		    i == digit_count + 1 + 4 + 6 ||
+		    i == digit_count + 1 + 4 + 6 + 6) {
 			fputs(SEP_CROSS, stdout);
 		}
 		else {
@@ -260,7 +159,7 @@ static void print_separator(int c, int digit_count) {
 	putchar('\n');
 }
 
-static void print_table(struct sub_info *sub_infos, int n, int align_release_name) {
+static void print_table(struct sth_sub_info *sub_infos, int n, int align_release_name) {
 	// count number of digits
 	int digit_count = 0;
 	int n_tmp = n;
@@ -271,30 +170,32 @@ static void print_table(struct sub_info *sub_infos, int n, int align_release_nam
 
 	// header
 	putchar('\n');
-	int c = printf("%-*c " SEP_VERTICAL " %c " SEP_VERTICAL " %s " SEP_VERTICAL " %-*s\n",
+	int c = printf("%-*c " SEP_VERTICAL " %c " SEP_VERTICAL " %s " SEP_VERTICAL " %s " SEP_VERTICAL " %-*s\n",
 	               digit_count,
 	               HEADER_ID,
 	               HEADER_MATCHED_BY_HASH,
+	               HEADER_SCORE,
 	               HEADER_LANG,
 	               align_release_name,
 	               HEADER_RELEASE_NAME);
 
-	c -= 5;
+	c -= 7;
 
 	// separator
 	print_separator(c, digit_count);
 
 	// list
 	for (int i = 0; i < n; i++) {
-		printf("%-*i " SEP_VERTICAL " %c " SEP_VERTICAL " %s " SEP_VERTICAL " %-*s\n",
+		printf("%-*i " SEP_VERTICAL " %c " SEP_VERTICAL " %3d " SEP_VERTICAL " %s " SEP_VERTICAL " %-*s\n",
 		       digit_count,
 		       i + 1,
 		       sub_infos[i].matched_by_hash ? '*' : ' ',
+		       sub_infos[i].score,
 		       sub_infos[i].lang,
 		       align_release_name,
 		       sub_infos[i].release_name);
 
-		printf("%-*s " SEP_VERTICAL "   " SEP_VERTICAL "     " SEP_VERTICAL " " SEP_UP_RIGHT "%s\n",
+		printf("%-*s " SEP_VERTICAL "   " SEP_VERTICAL "     " SEP_VERTICAL "     " SEP_VERTICAL " " SEP_UP_RIGHT "%s\n",
 		       digit_count,
 		       "",
 		       sub_infos[i].filename);
@@ -305,10 +206,15 @@ static void print_table(struct sub_info *sub_infos, int n, int align_release_nam
 	putchar('\n');
 }
 
-static const char *get_sub_path(const char *filepath, const char *sub_filename) {
+/*
+ * the path to write a subtitle of the video filepath to. With sub_lang (for
+ * --per-language) it is named like the video with the language in front of
+ * the extension, e.g. movie.eng.srt.
+ */
+static const char *get_sub_path(const char *filepath, const char *sub_filename, const char *sub_lang) {
 	char *sub_filepath;
 
-	if (same_name) {
+	if (same_name || sub_lang) {
 		const char *sub_ext = strrchr(sub_filename, '.');
 		if (!sub_ext) {
 			log_err("warning: subtitle filename from the OpenSubtitles.org "
@@ -322,12 +228,16 @@ static const char *get_sub_path(const char *filepath, const char *sub_filename)
 		else
 			index = (lastdot - filepath);
 
-		sub_filepath = malloc(index + 1 + strlen(sub_ext) + 1);
+		sub_filepath = malloc(index + 1 + (sub_lang ? strlen(sub_lang) + 1 : 0) + strlen(sub_ext) + 1);
 		if (!sub_filepath)
 			return NULL;
 
 		strncpy(sub_filepath, filepath, index);
 		sub_filepath[index] = '\0';
+		if (sub_lang) {
+			strcat(sub_filepath, ".");
+			strcat(sub_filepath, sub_lang);
+		}
 		strcat(sub_filepath, sub_ext);
 	} else {
 		const char *lastslash = strrchr(filepath, '/');
@@ -349,119 +259,6 @@ static const char *get_sub_path(const char *filepath, const char *sub_filename)
 	return sub_filepath;
 }
 
-static int sub_download(const char *token, int sub_id, const char *file_path) {
-	_cleanup_xmlrpc_ xmlrpc_value *sub_id_xmlval = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *query_array = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;;
-
-	_cleanup_xmlrpc_ xmlrpc_value *data = NULL;       // result -> data
-	_cleanup_xmlrpc_ xmlrpc_value *data_0 = NULL;     // result -> data[0]
-	_cleanup_xmlrpc_ xmlrpc_value *data_0_sub = NULL; // result -> data[0][data]
-
-	_cleanup_free_ const char *sub_base64 = NULL;	  // the subtitle, gzipped and base64 encoded
-
-	// zlib stuff, see also http://zlib.net/zlib_how.html
-	int z_ret;
-	z_stream z_strm;
-	unsigned char z_out[ZLIB_CHUNK];
-	unsigned char z_in[ZLIB_CHUNK];
-	z_strm.zalloc = Z_NULL;
-	z_strm.zfree = Z_NULL;
-	z_strm.opaque = Z_NULL;
-	z_strm.avail_in = 0;
-	z_strm.next_in = Z_NULL;
-
-	_cleanup_fclose_ FILE *f = NULL;
-	int r = 0;
-
-	// check if file already exists
-	if (access(file_path, F_OK) == 0) {
-		if (force_overwrite) {
-			log_info("file already exists, overwriting.");
-		} else {
-			log_err("file already exists, aborting. Use -f to force an overwrite.");
-			return EEXIST;
-		}
-	}
-
-	// download
-	sub_id_xmlval = xmlrpc_int_new(&env, sub_id);
-
-	query_array = xmlrpc_array_new(&env);
-	xmlrpc_array_append_item(&env, query_array, sub_id_xmlval);
-
-	xmlrpc_client_call2f(&env, client, STH_XMLRPC_URL, "DownloadSubtitles", &result, "(sA)", token, query_array);
-	if (env.fault_occurred) {
-		log_err("query failed: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
-	}
-
-	// get base64 encoded data
-	xmlrpc_struct_find_value(&env, result, "data", &data);
-	xmlrpc_array_read_item(&env, data, 0, &data_0);
-	xmlrpc_struct_find_value(&env, data_0, "data", &data_0_sub);
-	xmlrpc_read_string(&env, data_0_sub, &sub_base64);
-
-	// decode and decompress to file
-	f = fopen(file_path, "w+");
-	if (!f) {
-		perror("failed to open output file");
-		return errno;
-	}
-
-	// 16+MAX_WBITS is needed for gzip support
-	z_ret = inflateInit2(&z_strm, 16 + MAX_WBITS);
-	if (z_ret != Z_OK) {
-		log_err("failed to init zlib (%i)", z_ret);
-		return z_ret;
-	}
-
-	int b64_state = 0;
-	unsigned int b64_save = 0;
-	unsigned int b64_offset = 0;
-	do {
-		// write decoded data to z_in
-		z_strm.avail_in = g_base64_decode_step(&sub_base64[b64_offset], ZLIB_CHUNK, z_in, &b64_state, &b64_save);
-		b64_offset += z_strm.avail_in * 4 / 3; //  base64 encodes 3 bytes in 4 chars
-		if (z_strm.avail_in == 0)
-			break;
-
-		z_strm.next_in = z_in;
-
-		// decompress decoded data from z_in to z_out
-		do {
-			z_strm.avail_out = ZLIB_CHUNK;
-			z_strm.next_out = z_out;
-			z_ret = inflate(&z_strm, Z_NO_FLUSH);
-
-			switch (z_ret) {
-			case Z_NEED_DICT:
-				z_ret = Z_DATA_ERROR;
-				// fallthrough
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-				r = z_ret;
-				log_err("zlib error: %s (%d)", z_strm.msg, z_ret);
-				goto finish;
-			}
-			// write decompressed data from z_out to file
-			unsigned int have = ZLIB_CHUNK - z_strm.avail_out;
-
-			size_t written = fwrite(z_out, 1, have, f);
-			if (written != have) {
-				log_err("failed to write file: %m");
-				r = errno;
-				goto finish;
-			}
-		} while (z_strm.avail_out == 0);
-	} while (z_ret != Z_STREAM_END);
-
-finish:
-	inflateEnd(&z_strm);
-
-	return r;
-}
-
 static int select_1_out_of(int n) {
 	_cleanup_free_ char *line = NULL;
 	size_t len = 0;
@@ -480,34 +277,24 @@ static int select_1_out_of(int n) {
 	return sel;
 }
 
-static int download_chosen_results(const char *filepath, const char *token, xmlrpc_value *results, int n) {
+/*
+ * lets the user choose a subtitle, unless the best ranked one scores at least
+ * min_score. Subtitles chosen interactively are downloaded right away, the
+ * others together with those of the other files of the batch.
+ * sub_lang is passed to get_sub_path().
+ */
+static int download_chosen_results(struct sth_file *file, const char *sub_lang, struct sth_sub_info *sub_infos, int n) {
+	const char *filepath = sth_file_path(file);
 	int r = 0;
-	struct sub_info sub_infos[n];
 
-	int sel = 0; // selected list item
+	// selected list item
+	int sel = sth_select(sub_infos, n, min_score) + 1;
 
 	/* Make the values in the "Release / File Name" column
 	 * at least as long as the header title itself. */
 	int align_release_name = strlen(HEADER_RELEASE_NAME);
 
 	for (int i = 0; i < n; i++) {
-		_cleanup_xmlrpc_ xmlrpc_value *oneresult = NULL;
-		xmlrpc_array_read_item(&env, results, i, &oneresult);
-
-		// dear OpenSubtitles.org, why are these IDs provided as strings?
-		_cleanup_free_ const char *sub_id_str = struct_get_string(oneresult, "IDSubtitleFile");
-		_cleanup_free_ const char *matched_by_str = struct_get_string(oneresult, "MatchedBy");
-
-		sub_infos[i].id = strtol(sub_id_str, NULL, 10);
-		sub_infos[i].matched_by_hash = strcmp(matched_by_str, "moviehash") == 0;
-		sub_infos[i].lang = struct_get_string(oneresult, "SubLanguageID");
-		sub_infos[i].release_name = struct_get_string(oneresult, "MovieReleaseName");
-		sub_infos[i].filename = struct_get_string(oneresult, "SubFileName");
-
-		// select first hash match if one exists
-		if (sub_infos[i].matched_by_hash && sel == 0)
-			sel = i + 1;
-
 		int s = strlen(sub_infos[i].release_name);
 		if (s > align_release_name)
 			align_release_name = s;
@@ -524,46 +311,66 @@ static int download_chosen_results(const char *filepath, const char *token, xmlr
 		print_table(sub_infos, n, align_release_name);
 		// let user choose the subtitle to download
 		sel = select_1_out_of(n);
-		if (sel <= 0) {
-			r = -sel;
-			goto finish;
-		}
-		_cleanup_free_ const char *sub_filepath = get_sub_path(filepath, sub_infos[sel - 1].filename);
-		if (!sub_filepath) {
-			r = log_oom();
-			goto finish;
-		}
-		log_info("downloading to %s ...", sub_filepath);
-		r = sub_download(token, sub_infos[sel - 1].id, sub_filepath);
+		if (sel <= 0)
+			return -sel;
+
+		_cleanup_free_ const char *sub_path = get_sub_path(filepath, sub_infos[sel - 1].filename, sub_lang);
+		if (!sub_path)
+			return log_oom();
+
+		log_info("downloading to %s ...", sub_path);
+		r = sth_file_download(file, &sub_infos[sel - 1], sub_path);
 		if (r != 0 || n == 1)
-			goto finish;
+			return r;
 		sel = 0;
 	}
 
 	if (!quiet)
 		print_table(sub_infos, n, align_release_name);
 
-	_cleanup_free_ const char *sub_filepath = get_sub_path(filepath, sub_infos[sel - 1].filename);
-	if (!sub_filepath) {
-		r = log_oom();
-		goto finish;
-	}
-	log_info("downloading to %s ...", sub_filepath);
-	r = sub_download(token, sub_infos[sel - 1].id, sub_filepath);
+	_cleanup_free_ const char *sub_path = get_sub_path(filepath, sub_infos[sel - 1].filename, sub_lang);
+	if (!sub_path)
+		return log_oom();
 
-finish:
-	// __attribute__(cleanup) can't be used in structs, let alone arrays
+	log_info("downloading to %s ...", sub_path);
+
+	return sth_file_choose(file, &sub_infos[sel - 1], sub_path);
+}
+
+/*
+ * --per-language: chooses a subtitle for every language among the results,
+ * like download_chosen_results() does for all of them.
+ */
+static int download_per_language(struct sth_file *file, struct sth_sub_info *sub_infos, int n) {
+	_cleanup_free_ struct sth_sub_info *group = malloc(n * sizeof(struct sth_sub_info));
+	_cleanup_free_ bool *grouped = calloc(n, sizeof(bool));
+	if (!group || !grouped)
+		return log_oom();
+
+	// the results are ranked, so the languages are in the order of their best result
 	for (int i = 0; i < n; i++) {
-		free((void *)sub_infos[i].lang);
-		free((void *)sub_infos[i].release_name);
-		free((void *)sub_infos[i].filename);
+		if (grouped[i])
+			continue;
+
+		int count = 0;
+		for (int j = i; j < n; j++) {
+			if (!grouped[j] && strcmp(sub_infos[j].lang, sub_infos[i].lang) == 0) {
+				group[count++] = sub_infos[j];
+				grouped[j] = true;
+			}
+		}
+
+		log_info("%s:", sub_infos[i].lang);
+		int r = download_chosen_results(file, sub_infos[i].lang, group, count);
+		if (r != 0)
+			return r;
 	}
 
-	return r;
+	return 0;
 }
 
 static void show_usage() {
-	puts("Usage: subberthehut [options] <file>...\n\n"
+	fputs("Usage: subberthehut [options] <file>...\n\n"
 
 	     "OpenSubtitles.org downloader.\n\n"
 
@@ -580,9 +387,15 @@ static void show_usage() {
 	     "file. Therefore subberthehut will, by default, ask the user which subtitle to\n"
 	     "download.\n"
 	     "Results from the hash-based search are marked with an asterisk (*)\n"
-	     "in the 'H' column.\n\n"
-
-	     "Options:\n"
+	     "in the 'H' column.\n"
+	     "The results are ranked by a score from 0 to 100, which adds up whether\n"
+	     "they match the hash, how similar their names are to the filename, their\n"
+	     "frame rate, downloads, rating and uploader. The best one scoring at least\n"
+	     "--min-score is downloaded without asking. Up to a --min-score of 50, the\n"
+	     "best hash match is taken first, even if a name match ranks higher or it\n"
+	     "was reported as bad.\n\n", stdout);
+
+	fputs("Options:\n"
 	     " -h, --help              Show this help and exit.\n"
 	     "\n"
 	     " -v, --version           Show version information and exit.\n"
@@ -612,7 +425,144 @@ static void show_usage() {
 	     " -s, --same-name         Download the subtitle to the same filename as the\n"
 	     "                         original file, only replacing the file extension.\n"
 	     "\n"
-	     " -t, --limit <number>    Limits the number of returned results. The default is 10.\n"
+	     " --utf8                  Convert the subtitles to UTF-8 while writing them.\n"
+	     "                         The encoding is detected from the subtitle and the\n"
+	     "                         one OpenSubtitles.org reports.\n"
+	     "\n"
+	     " --unix-newlines         Write the line endings of the subtitles as \\n\n"
+	     "                         instead of \\r\\n.\n"
+	     "\n"
+	     " --strip-bom             Don't write the UTF-8 byte order mark of subtitles.\n"
+	     "\n"
+	     " --ndjson                Only search, don't download anything: write a line\n"
+	     "                         of JSON per file to stdout with its path, hash, size\n"
+	     "                         and ranked results (or an error code). Messages go\n"
+	     "                         to stderr instead.\n"
+	     "\n"
+	     " --per-language          Download the best subtitle of every language found,\n"
+	     "                         e.g. with -l eng,ger. They are named like the video\n"
+	     "                         with the language in front of the extension, e.g.\n"
+	     "                         movie.eng.srt. -r and -w skip videos which have a\n"
+	     "                         subtitle of every language of -l. The limit of -t\n"
+	     "                         applies per language.\n"
+	     "\n"
+	     " -r, --recursive         Search the directories passed as <file> for videos\n"
+	     "                         recursively. Videos with a subtitle named like the\n"
+	     "                         video next to them (e.g. movie.srt for movie.mkv,\n"
+	     "                         matched case-sensitively) are skipped, unless -f is\n"
+	     "                         passed. Without -s, subtitles are named like on the\n"
+	     "                         server, which can't be recognized up front.\n"
+	     "\n"
+	     " -w, --watch             Watch the directories passed as <file> (and all\n"
+	     "                         directories below them) and download subtitles for\n"
+	     "                         new videos as soon as they have been written.\n"
+	     "                         Implies --never-ask and --no-exit-on-fail.\n"
+	     "\n", stdout);
+
+	fputs(" --serve <socket>        Answer requests on the Unix domain socket <socket>,\n"
+	     "                         with one session for all of them. A request is its\n"
+	     "                         length as 4 bytes in network byte order, followed\n"
+	     "                         by key=value lines:\n"
+	     "                           path=   the absolute path of the video; only\n"
+	     "                                   its name if hash and size are given\n"
+	     "                                   (required)\n"
+	     "                           hash=   the hash as 16 hex digits, with size=\n"
+	     "                                   and out=\n"
+	     "                           size=   the size of the video in bytes\n"
+	     "                           lang=   the languages, instead of -l\n"
+	     "                           policy= score (the default): the best subtitle\n"
+	     "                                   scoring at least --min-score;\n"
+	     "                                   best: the best one regardless\n"
+	     "                           out=    the absolute path to write the subtitle\n"
+	     "                                   to, instead of next to the video\n"
+	     "                         The response is framed the same way: status=0 and\n"
+	     "                         sub=, id= and score= of the subtitle written, or\n"
+	     "                         status=<errno> and error=.\n"
+	     "                         Requests are handled in rounds: those which arrived\n"
+	     "                         while the previous round ran are searched for with\n"
+	     "                         a single request to the server, identical ones only\n"
+	     "                         once. No requests are read while a round runs, so\n"
+	     "                         a slow round delays all clients.\n"
+	     "                         The socket is only accessible by the user running\n"
+	     "                         subberthehut, which writes the subtitles wherever\n"
+	     "                         its clients ask to.\n"
+	     "                         Implies --never-ask and --no-exit-on-fail.\n"
+	     "\n", stdout);
+
+	fputs(" -t, --limit <number>    Limits the number of returned results. The default is 10.\n"
+	     "\n"
+	     " -b, --batch-size <number>\n"
+	     "                         Search for up to this many files with a single\n"
+	     "                         request, which saves a round trip to the server\n"
+	     "                         per file. The default is 1.\n"
+	     "\n"
+	     " -j, --jobs <number>     Number of files of a batch to read in parallel\n"
+	     "                         when generating their hashes. The default is 4.\n"
+	     "\n"
+	     " --no-hash-cache         Don't look up the hashes of unchanged files in\n"
+	     "                         $XDG_CACHE_HOME/subberthehut/hashes, always read\n"
+	     "                         the files instead.\n"
+	     "\n"
+	     " --no-search-cache       Always ask the server, don't use search results\n"
+	     "                         cached in $XDG_CACHE_HOME/subberthehut/search.\n"
+	     "\n"
+	     " --blob-store            Keep the subtitles written in\n"
+	     "                         $XDG_CACHE_HOME/subberthehut/blobs, and take them\n"
+	     "                         from there instead of downloading them again. They\n"
+	     "                         are cloned or copied to their destination. Those\n"
+	     "                         not used for 90 days are removed.\n"
+	     "\n"
+	     " --index <dir>           Look the videos up in the index of a local mirror of\n"
+	     "                         subtitles in <dir> first, and copy the subtitles\n"
+	     "                         found there instead of asking the server.\n"
+	     "\n"
+	     " --build-index <dir>     Build the index of <dir> for --index from\n"
+	     "                         <dir>/manifest.tsv and exit. Every line of the\n"
+	     "                         manifest has the tab separated moviehash, bytesize,\n"
+	     "                         language and path (relative to <dir>, optionally\n"
+	     "                         gzipped) of a subtitle, optionally followed by its\n"
+	     "                         OpenSubtitles.org ID, fps and release name.\n"
+	     "\n"
+	     " --search-cache-ttl <seconds>\n"
+	     "                         Maximum age of cached search results. The default\n"
+	     "                         is 86400 (one day), 0 disables the cache. Searches\n"
+	     "                         without results are cached for an hour at most.\n"
+	     "                         Expired results are removed once a day.\n"
+	     "\n", stdout);
+
+	puts(" --max-inflight <number> Maximum number of requests to the server at the\n"
+	     "                         same time. The default is 4.\n"
+	     "\n"
+	     " --min-score <0-100>     Download the best ranked subtitle scoring at least\n"
+	     "                         this high without asking. Up to 50 (the default),\n"
+	     "                         the best hash match is taken first, like before\n"
+	     "                         the ranking; lower it to also pick name-based\n"
+	     "                         results unattended if there is no hash match.\n"
+	     "\n"
+	     " --rate-limit <number>   Maximum number of requests per 10 seconds. The\n"
+	     "                         default is 40, the limit of OpenSubtitles.org.\n"
+	     "                         Requests the server throttles are retried later,\n"
+	     "                         and the rate is lowered until they are accepted.\n"
+	     "\n"
+	     " --timeout <seconds>     Give up on a request (and retry it later) if it\n"
+	     "                         takes longer than this. The default is 60.\n"
+	     "\n"
+	     " --connect-timeout <seconds>\n"
+	     "                         Give up connecting to the server after this long.\n"
+	     "                         The default is 10.\n"
+	     "\n"
+	     " --http2                 Prefer HTTP/2 for the searches, which then share a\n"
+	     "                         single connection.\n"
+	     "\n"
+	     " --server <url>          XML-RPC endpoint to use instead of\n"
+	     "                         " STH_XMLRPC_URL ",\n"
+	     "                         e.g. a local mirror or a test server.\n"
+	     "\n"
+	     " --stats <file>          Write the time spent hashing, logging in, searching,\n"
+	     "                         downloading and decoding, per file and in total, and\n"
+	     "                         the number of bytes read and written to <file> as\n"
+	     "                         JSON, or in the Prometheus textfile format if <file>\n"
+	     "                         ends in .prom (without the per file numbers).\n"
 	     "\n"
 	     " -e, --no-exit-on-fail   By default, subberthehut will exit immediately if\n"
 	     "                         multiple files are passed and it fails to download\n"
@@ -629,167 +579,1575 @@ static void show_version() {
 	     "https://github.com/samunders-core/subberthehut/");
 }
 
-static int process_file(const char *filepath, const char *token) {
-	_cleanup_fclose_ FILE *f = NULL;
-	uint64_t hash = 0, filesize = 0;
+/*
+ * a growing buffer for output which is written at once. Running out of
+ * memory is remembered in failed, so that callers only check once.
+ */
+struct out_buf {
+	char *data;
+	size_t len;
+	size_t capacity;
+	bool failed;
+};
 
-	_cleanup_xmlrpc_ xmlrpc_value *results = NULL;
+static bool out_reserve(struct out_buf *out, size_t n) {
+	if (out->failed)
+		return false;
+	if (out->len + n <= out->capacity)
+		return true;
 
-	_cleanup_free_ const char *sub_filename = NULL;
-	_cleanup_free_ const char *sub_filepath = NULL;
+	size_t capacity = out->capacity ? 2 * out->capacity : 65536;
+	while (capacity < out->len + n)
+		capacity *= 2;
 
-	int r = 0;
+	char *data = realloc(out->data, capacity);
+	if (!data) {
+		out->failed = true;
+		return false;
+	}
+	out->data = data;
+	out->capacity = capacity;
+	return true;
+}
 
-	// get hash/filesize
-	if (!name_search_only) {
-		f = fopen(filepath, "r");
-		if (!f) {
-			log_err("failed to open %s: %m", filepath);
-			return errno;
-		}
+static void out_printf(struct out_buf *out, const char *format, ...) {
+	va_list args;
 
-		get_hash_and_filesize(f, &hash, &filesize);
+	va_start(args, format);
+	int n = vsnprintf(out->data ? out->data + out->len : NULL, out->capacity - out->len, format, args);
+	va_end(args);
+	if (n < 0) {
+		out->failed = true;
+		return;
 	}
 
-	const char *filename = strrchr(filepath, '/');
-	if (filename)
-		filename++; // skip '/'
-	else
-		filename = filepath;
-
-	log_info("searching for %s...", filename);
+	if (out->len + n >= out->capacity) {
+		if (!out_reserve(out, n + 1))
+			return;
+		va_start(args, format);
+		vsnprintf(out->data + out->len, out->capacity - out->len, format, args);
+		va_end(args);
+	}
+	out->len += n;
+}
 
-	r = search_get_results(token, hash, filesize, filename, &results);
-	if (r != 0)
-		return r;
+/*
+ * the length of the valid UTF-8 sequence s starts with, 0 if it is invalid
+ * (truncated, overlong, a surrogate or beyond U+10FFFF).
+ */
+static int utf8_sequence_len(const unsigned char *s) {
+	int n = s[0] < 0x80 ? 1 : s[0] < 0xc2 ? 0 : s[0] < 0xe0 ? 2 : s[0] < 0xf0 ? 3 : s[0] < 0xf5 ? 4 : 0;
 
-	int results_length = xmlrpc_array_size(&env, results);
-	if (env.fault_occurred) {
-		log_err("failed to get array size: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+	for (int i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
 	}
 
-	if (results_length == 0) {
-		log_err("no results.");
-		return 1;
+	if ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] >= 0xa0) ||
+	    (s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] >= 0x90))
+		return 0;
+	return n;
+}
+
+/*
+ * bytes which aren't UTF-8 (e.g. of paths in a legacy encoding) are
+ * replaced by U+FFFD each, so that the line is still valid JSON.
+ */
+static void out_json_string(struct out_buf *out, const char *s) {
+	// every byte takes at most 6 bytes escaped
+	if (!out_reserve(out, 6 * strlen(s) + 3))
+		return;
+
+	char *d = out->data + out->len;
+	*d++ = '"';
+	while (*s) {
+		unsigned char c = *s;
+		int n = utf8_sequence_len((const unsigned char *) s);
+		if (n == 0) {
+			d += sprintf(d, "\\ufffd");
+			s++;
+		} else if (c == '"' || c == '\\') {
+			*d++ = '\\';
+			*d++ = c;
+			s++;
+		} else if (c < 0x20) {
+			d += sprintf(d, "\\u%04x", c);
+			s++;
+		} else {
+			memcpy(d, s, n);
+			d += n;
+			s += n;
+		}
 	}
+	*d++ = '"';
+	out->len = d - out->data;
+}
 
-	return download_chosen_results(filepath, token, results, results_length);
+static int out_flush(struct out_buf *out, int fd) {
+	int r = write_full(fd, (const unsigned char *) out->data, out->len);
+	out->len = 0;
+	return r;
 }
 
-static int list_sub_languages() {
-	_cleanup_xmlrpc_ xmlrpc_value *result = NULL;
-	_cleanup_xmlrpc_ xmlrpc_value *languages = NULL;
+static void out_free(struct out_buf *out) {
+	free(out->data);
+	memset(out, 0, sizeof(*out));
+}
 
-	xmlrpc_client_call2f(&env, client, STH_XMLRPC_URL, "GetSubLanguages", &result, "()");
-	if (env.fault_occurred) {
-		log_err("failed to download languages: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+/*
+ * --ndjson: a line of JSON per file with all its results, ranked, instead of
+ * choosing and downloading a subtitle. The lines of a batch are written to
+ * stdout together.
+ */
+static struct out_buf ndjson_out;
+
+static int ndjson_add_file(struct sth_file *file) {
+	struct out_buf *out = &ndjson_out;
+	uint64_t hash;
+	uint64_t size;
+	int n;
+
+	out_printf(out, "{\"file\":");
+	out_json_string(out, sth_file_path(file));
+	if (sth_file_hash(file, &hash, &size))
+		out_printf(out, ",\"hash\":\"%016" PRIx64 "\",\"size\":%" PRIu64, hash, size);
+
+	if (sth_file_error(file) != 0) {
+		out_printf(out, ",\"error\":%d}\n", sth_file_error(file));
+		return out->failed ? log_oom() : 0;
 	}
 
-	xmlrpc_struct_read_value(&env, result, "data", &languages);
-	if (env.fault_occurred) {
-		log_err("failed to get data: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+	const struct sth_sub_info *sub_infos = sth_file_results(file, &n);
+
+	out_printf(out, ",\"results\":[");
+	for (int i = 0; i < n; i++) {
+		const struct sth_sub_info *sub_info = &sub_infos[i];
+		out_printf(out, "%s{\"id\":%d,\"lang\":", i ? "," : "", sub_info->id);
+		out_json_string(out, sub_info->lang);
+		out_printf(out, ",\"release_name\":");
+		out_json_string(out, sub_info->release_name);
+		out_printf(out, ",\"filename\":");
+		out_json_string(out, sub_info->filename);
+		out_printf(out, ",\"encoding\":");
+		out_json_string(out, sub_info->encoding);
+		out_printf(out, ",\"matched_by_hash\":%s,\"score\":%d,\"fps\":%g,\"downloads\":%d,"
+		           "\"rating\":%g,\"uploader_rank\":%d,\"bad\":%s,\"local\":%s}",
+		           sub_info->matched_by_hash ? "true" : "false", sub_info->score, sub_info->fps,
+		           sub_info->downloads, sub_info->rating, sub_info->uploader_rank,
+		           sub_info->bad ? "true" : "false", sub_info->local_path ? "true" : "false");
 	}
+	out_printf(out, "]}\n");
+
+	return out->failed ? log_oom() : 0;
+}
 
-	int n = xmlrpc_array_size(&env, languages);
-	if (env.fault_occurred) {
-		log_err("failed to get array size: %s (%d)", env.fault_string, env.fault_code);
-		return env.fault_code;
+static int ndjson_flush() {
+	if (ndjson_out.failed) {
+		ndjson_out.len = 0;
+		ndjson_out.failed = false;
+		return ENOMEM;
 	}
 
-	for (int i = 0; i < n; i++) {
-		_cleanup_xmlrpc_ xmlrpc_value *language = NULL;
-		xmlrpc_array_read_item(&env, languages, i, &language);
+	int r = out_flush(&ndjson_out, STDOUT_FILENO);
+	if (r != 0)
+		log_err("failed to write to stdout: %s", strerror(r));
+	return r;
+}
 
-		_cleanup_free_ const char *lang_id = struct_get_string(language, "SubLanguageID");
-		_cleanup_free_ const char *lang_name = struct_get_string(language, "LanguageName");
+static int process_file(struct sth_file *file, bool print_name) {
+	const char *filepath = sth_file_path(file);
+	int n;
+	struct sth_sub_info *sub_infos = sth_file_results(file, &n);
 
-		printf("%s - %s\n", lang_id, lang_name);
+	if (print_name) {
+		const char *filename = strrchr(filepath, '/');
+		log_info("%s:", filename ? filename + 1 : filepath);
 	}
 
-	return 0;
+	if (n == 0) {
+		log_err("no results.");
+		return 1;
+	}
+
+	if (per_language)
+		return download_per_language(file, sub_infos, n);
+
+	return download_chosen_results(file, NULL, sub_infos, n);
 }
 
-int main(int argc, char *argv[]) {
-	_cleanup_free_ const char *token = NULL;
+/*
+ * called back for every file once it was searched for, data tells whether
+ * to print its name.
+ */
+static int choose(struct sth_context *ctx, struct sth_file *file, void *data) {
+	(void) ctx;
 
-	int r = EXIT_SUCCESS;
+	// with --ndjson, the files of a failed search get a record as well
+	if (ndjson)
+		return ndjson_add_file(file);
+	if (sth_file_error(file) != 0)
+		return sth_file_error(file);
 
-	// parse options
-	const struct option opts[] = {
-		{"help", no_argument, NULL, 'h'},
-		{"lang", required_argument, NULL, 'l'},
-		{"list-languages", no_argument, NULL, 'L'},
-		{"always-ask", no_argument, NULL, 'a'},
-		{"never-ask", no_argument, NULL, 'n'},
-		{"force", no_argument, NULL, 'f'},
-		{"hash-search-only", no_argument, NULL, 'o'},
-		{"name-search-only", no_argument, NULL, 'O'},
-		{"same-name", no_argument, NULL, 's'},
-		{"limit", required_argument, NULL, 't'},
-		{"no-exit-on-fail", no_argument, NULL, 'e'},
-		{"quiet", no_argument, NULL, 'q'},
-		{"version", no_argument, NULL, 'v'},
-		{0, 0, 0, 0}
-	};
+	return process_file(file, *(bool *) data);
+}
 
-	int c;
-	while ((c = getopt_long(argc, argv, "hl:LanfoOst:eqv", opts, NULL)) != -1) {
-		switch (c) {
-		case 'h':
-			show_usage();
-			return EXIT_SUCCESS;
+static int batch_done(struct sth_context *ctx, void *data) {
+	(void) ctx;
+	(void) data;
 
-		case 'l':
-			lang = optarg;
-			break;
+	return ndjson ? ndjson_flush() : 0;
+}
 
-		case 'L':
-			list_languages = true;
-			break;
+static int process_files(struct sth_context *ctx, char **filepaths, int count) {
+	bool print_names = options.batch_size > 1 && count > 1;
+	struct sth_callbacks callbacks = {
+		.choose = choose,
+		.batch_done = batch_done,
+		.data = &print_names,
+	};
 
-		case 'a':
-			always_ask = true;
-			break;
+	return sth_process_files(ctx, filepaths, count, &callbacks);
+}
 
-		case 'n':
-			never_ask = true;
-			break;
+static void print_language(const char *id, const char *name, void *data) {
+	(void) data;
 
-		case 'f':
-			force_overwrite = true;
-			break;
+	printf("%s - %s\n", id, name);
+}
 
-		case 'o':
-			hash_search_only = true;
-			name_search_only = false;
-			break;
+/*
+ * a growing list of file paths.
+ */
+struct file_list {
+	char **paths;
+	int count;
+	int capacity;
+};
 
-		case 'O':
-			name_search_only = true;
-			hash_search_only = false;
-			break;
+static int file_list_add(struct file_list *list, char *path) {
+	if (list->count == list->capacity) {
+		int capacity = list->capacity ? 2 * list->capacity : 64;
+		char **paths = realloc(list->paths, capacity * sizeof(char *));
+		if (!paths) {
+			free(path);
+			return ENOMEM;
+		}
+		list->paths = paths;
+		list->capacity = capacity;
+	}
 
-		case 's':
-			same_name = true;
-			break;
+	list->paths[list->count++] = path;
+	return 0;
+}
 
-		case 't':
-		{
-			char *endptr = NULL;
-			limit = strtol(optarg, &endptr, 10);
+static void file_list_free(struct file_list *list) {
+	for (int i = 0; i < list->count; i++)
+		free(list->paths[i]);
+	free(list->paths);
+}
 
-			if (*endptr != '\0' || limit < 1) {
+static bool has_extension(const char *name, const char *const *extensions) {
+	const char *ext = strrchr(name, '.');
+	if (!ext || ext == name)
+		return false;
+
+	for (int i = 0; extensions[i]; i++) {
+		if (strcasecmp(ext + 1, extensions[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+struct dir_entry {
+	char *name;
+	unsigned char type; // d_type
+};
+
+static int compare_dir_entries(const void *a, const void *b) {
+	return strcmp(((const struct dir_entry *) a)->name, ((const struct dir_entry *) b)->name);
+}
+
+/*
+ * checks if name exists among the (sorted) entries of its directory, or on
+ * disk if there are no entries.
+ */
+static bool sub_exists(char *name, const struct dir_entry *entries, int count) {
+	if (!entries)
+		return access(name, F_OK) == 0;
+
+	struct dir_entry key = { .name = name };
+	return bsearch(&key, entries, count, sizeof(struct dir_entry), compare_dir_entries) != NULL;
+}
+
+/*
+ * checks if name is stem.<lang>.<ext>, the name of a subtitle of any language.
+ */
+static bool is_lang_sub(const char *name, const char *stem, int stem_len) {
+	if (strncmp(name, stem, stem_len) != 0 || name[stem_len] != '.')
+		return false;
+
+	const char *lang_code = name + stem_len + 1;
+	const char *dot = strchr(lang_code, '.');
+	return dot && dot > lang_code && !strchr(dot + 1, '.') && has_extension(lang_code, sub_extensions);
+}
+
+/*
+ * --per-language with all languages: checks for a subtitle of any language.
+ * stem is a path if there are no entries.
+ */
+static bool has_any_lang_sub(const char *stem, int stem_len, const struct dir_entry *entries, int count) {
+	if (entries) {
+		// the names starting with stem are next to each other
+		int lo = 0;
+		int hi = count;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (strncmp(entries[mid].name, stem, stem_len) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		for (int i = lo; i < count && strncmp(entries[i].name, stem, stem_len) == 0; i++) {
+			if (is_lang_sub(entries[i].name, stem, stem_len))
+				return true;
+		}
+		return false;
+	}
+
+	int dir_len = stem_len;
+	while (dir_len > 0 && stem[dir_len - 1] != '/')
+		dir_len--;
+
+	char dir_path[dir_len + 2];
+	if (dir_len)
+		sprintf(dir_path, "%.*s", dir_len, stem);
+	else
+		strcpy(dir_path, ".");
+
+	DIR *dir = opendir(dir_path);
+	if (!dir)
+		return false;
+
+	bool found = false;
+	struct dirent *dirent;
+	while (!found && (dirent = readdir(dir)))
+		found = is_lang_sub(dirent->d_name, stem + dir_len, stem_len - dir_len);
+
+	closedir(dir);
+	return found;
+}
+
+/*
+ * checks for a subtitle of the video with the name stem (without the
+ * extension), i.e. one with a name get_sub_path() produces for --same-name,
+ * or with --per-language one for every language of --lang. The names are
+ * compared case-sensitively. Without --same-name, get_sub_path() uses the
+ * name on the server, which isn't known before searching, so those
+ * subtitles aren't found.
+ */
+static bool has_sub_named(const char *stem, int stem_len, const struct dir_entry *entries, int count) {
+	if (!per_language) {
+		for (int i = 0; sub_extensions[i]; i++) {
+			char name[stem_len + 1 + strlen(sub_extensions[i]) + 1];
+			sprintf(name, "%.*s.%s", stem_len, stem, sub_extensions[i]);
+			if (sub_exists(name, entries, count))
+				return true;
+		}
+		return false;
+	}
+
+	if (strcmp(options.lang, "all") == 0)
+		return has_any_lang_sub(stem, stem_len, entries, count);
+
+	for (const char *l = options.lang; *l; ) {
+		int len = strcspn(l, ",");
+		bool found = len == 0;
+
+		for (int i = 0; sub_extensions[i] && !found; i++) {
+			char name[stem_len + 1 + len + 1 + strlen(sub_extensions[i]) + 1];
+			sprintf(name, "%.*s.%.*s.%s", stem_len, stem, len, l, sub_extensions[i]);
+			found = sub_exists(name, entries, count);
+		}
+		if (!found)
+			return false;
+
+		l += len;
+		if (*l == ',')
+			l++;
+	}
+	return true;
+}
+
+/*
+ * checks the (sorted) entries of a directory for a subtitle next to the video.
+ */
+static bool has_subtitle(const char *video, const struct dir_entry *entries, int count) {
+	const char *lastdot = strrchr(video, '.');
+	int stem_len = lastdot ? lastdot - video : (int) strlen(video);
+
+	return has_sub_named(video, stem_len, entries, count);
+}
+
+/*
+ * adds all videos in the directory name (relative to parent_fd) and its
+ * subdirectories to list, except for those which already have a subtitle.
+ * d_type is used where the filesystem provides it, so that most entries
+ * need no stat() at all.
+ */
+static int scan_dir(int parent_fd, const char *dir_path, const char *name, struct file_list *list, int *skipped) {
+	int r = 0;
+	struct dir_entry *entries = NULL;
+	int count = 0;
+	int capacity = 0;
+
+	int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		log_err("failed to open %s: %m", dir_path);
+		return errno;
+	}
+
+	DIR *dir = fdopendir(fd);
+	if (!dir) {
+		log_err("failed to open %s: %m", dir_path);
+		close(fd);
+		return errno;
+	}
+
+	struct dirent *dirent;
+	while ((dirent = readdir(dir))) {
+		if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		if (count == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			struct dir_entry *new_entries = realloc(entries, capacity * sizeof(struct dir_entry));
+			if (!new_entries) {
+				r = log_oom();
+				goto finish;
+			}
+			entries = new_entries;
+		}
+
+		entries[count].name = strdup(dirent->d_name);
+		if (!entries[count].name) {
+			r = log_oom();
+			goto finish;
+		}
+		entries[count++].type = dirent->d_type;
+	}
+
+	qsort(entries, count, sizeof(struct dir_entry), compare_dir_entries);
+
+	for (int i = 0; i < count; i++) {
+		struct dir_entry *e = &entries[i];
+		_cleanup_free_ char *path = NULL;
+
+		if (e->type == DT_UNKNOWN || e->type == DT_LNK) {
+			// follow links to files, but not to directories (no loops)
+			struct stat st;
+			if (fstatat(fd, e->name, &st, e->type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+				continue;
+			if (S_ISREG(st.st_mode))
+				e->type = DT_REG;
+			else if (S_ISDIR(st.st_mode) && e->type == DT_UNKNOWN)
+				e->type = DT_DIR;
+		}
+
+		if (e->type == DT_DIR) {
+			if (asprintf(&path, "%s/%s", dir_path, e->name) == -1) {
+				r = log_oom();
+				goto finish;
+			}
+			int dir_r = scan_dir(fd, path, e->name, list, skipped);
+			if (dir_r == ENOMEM) {
+				r = dir_r;
+				goto finish;
+			}
+		} else if (e->type == DT_REG && has_extension(e->name, video_extensions)) {
+			if (!options.force_overwrite && has_subtitle(e->name, entries, count)) {
+				(*skipped)++;
+				continue;
+			}
+			if (asprintf(&path, "%s/%s", dir_path, e->name) == -1 ||
+			    file_list_add(list, path) != 0) {
+				r = log_oom();
+				goto finish;
+			}
+			path = NULL; // owned by list now
+		}
+	}
+
+finish:
+	closedir(dir);
+	for (int i = 0; i < count; i++)
+		free(entries[i].name);
+	free(entries);
+	return r;
+}
+
+/*
+ * collects the videos for --recursive: directories are scanned,
+ * other arguments are taken as they are.
+ */
+static int collect_files(char **args, int n, struct file_list *list) {
+	int skipped = 0;
+
+	for (int i = 0; i < n; i++) {
+		struct stat st;
+		int r;
+
+		if (stat(args[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+			// strip trailing slashes for nicer paths
+			_cleanup_free_ char *dir_path = strdup(args[i]);
+			if (!dir_path)
+				return log_oom();
+			for (size_t len = strlen(dir_path); len > 1 && dir_path[len - 1] == '/'; len--)
+				dir_path[len - 1] = '\0';
+
+			r = scan_dir(AT_FDCWD, dir_path, dir_path, list, &skipped);
+		} else {
+			char *path = strdup(args[i]);
+			r = path ? file_list_add(list, path) : ENOMEM;
+			if (r == ENOMEM)
+				log_oom();
+		}
+
+		if (r == ENOMEM)
+			return r;
+		if (r != 0 && options.exit_on_fail)
+			return r;
+	}
+
+	log_info("found %d videos without subtitles (%d skipped).", list->count, skipped);
+	return 0;
+}
+
+/*
+ * checks for a subtitle next to the video, like has_subtitle() does for --recursive.
+ */
+static bool has_subtitle_on_disk(const char *video) {
+	const char *lastdot = strrchr(video, '.');
+	const char *lastslash = strrchr(video, '/');
+	int stem_len = lastdot && (!lastslash || lastdot > lastslash) ? lastdot - video : (int) strlen(video);
+
+	return has_sub_named(video, stem_len, NULL, 0);
+}
+
+/*
+ * --watch: the inotify watch descriptors, indexed by wd, point to the watched directory.
+ */
+struct watch_set {
+	int fd;
+	char **paths;
+	int capacity;
+};
+
+// set by SIGINT and SIGTERM, ends --watch and --serve
+static volatile sig_atomic_t stop_requested;
+
+static void handle_stop_signal(int sig) {
+	(void) sig;
+	stop_requested = 1;
+}
+
+/*
+ * watches path and all directories below it.
+ */
+static int watch_add_tree(struct watch_set *ws, const char *path) {
+	int wd = inotify_add_watch(ws->fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+	if (wd == -1) {
+		log_err("failed to watch %s: %m", path);
+		return errno;
+	}
+
+	if (wd >= ws->capacity) {
+		int capacity = wd + 64;
+		char **paths = realloc(ws->paths, capacity * sizeof(char *));
+		if (!paths)
+			return log_oom();
+		memset(&paths[ws->capacity], 0, (capacity - ws->capacity) * sizeof(char *));
+		ws->paths = paths;
+		ws->capacity = capacity;
+	}
+
+	if (!ws->paths[wd]) {
+		ws->paths[wd] = strdup(path);
+		if (!ws->paths[wd])
+			return log_oom();
+	}
+
+	DIR *dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	struct dirent *dirent;
+	while ((dirent = readdir(dir))) {
+		if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		_cleanup_free_ char *subdir = NULL;
+		if (asprintf(&subdir, "%s/%s", path, dirent->d_name) == -1) {
+			closedir(dir);
+			return log_oom();
+		}
+
+		bool is_dir = dirent->d_type == DT_DIR;
+		if (dirent->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = lstat(subdir, &st) == 0 && S_ISDIR(st.st_mode);
+		}
+
+		if (is_dir && watch_add_tree(ws, subdir) == ENOMEM) {
+			closedir(dir);
+			return ENOMEM;
+		}
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/*
+ * videos waiting for WATCH_DEBOUNCE_MS without events, and without their
+ * size or mtime changing: videos of a new directory are queued without
+ * events of their own, while they may still be written.
+ */
+struct watch_state {
+	long long last_event; // in ms
+	off_t size;
+	struct timespec mtime;
+};
+
+struct watch_pending {
+	struct file_list files;
+	struct watch_state *states; // per file
+};
+
+static long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int watch_queue(struct watch_pending *pending, const char *path) {
+	for (int i = 0; i < pending->files.count; i++) {
+		if (strcmp(pending->files.paths[i], path) == 0) {
+			pending->states[i].last_event = now_ms();
+			return 0;
+		}
+	}
+
+	char *path_copy = strdup(path);
+	if (!path_copy || file_list_add(&pending->files, path_copy) != 0)
+		return log_oom();
+
+	struct watch_state *states = realloc(pending->states, pending->files.capacity * sizeof(struct watch_state));
+	if (!states) {
+		free(pending->files.paths[--pending->files.count]);
+		return log_oom();
+	}
+	pending->states = states;
+
+	struct stat st;
+	struct watch_state *state = &pending->states[pending->files.count - 1];
+	memset(state, 0, sizeof(*state));
+	state->last_event = now_ms();
+	if (stat(path, &st) == 0) {
+		state->size = st.st_size;
+		state->mtime = st.st_mtim;
+	}
+
+	return 0;
+}
+
+/*
+ * processes the pending videos which didn't change for WATCH_DEBOUNCE_MS,
+ * returns the time until the next one is due, or -1 if none is left.
+ */
+static int watch_process_due(struct sth_context *ctx, struct watch_pending *pending) {
+	struct file_list due = { 0 };
+	long long now = now_ms();
+	int timeout = -1;
+
+	for (int i = 0; i < pending->files.count; ) {
+		struct watch_state *state = &pending->states[i];
+		long long wait = state->last_event + WATCH_DEBOUNCE_MS - now;
+
+		// still being written, without an event telling so
+		struct stat st;
+		if (wait <= 0 && stat(pending->files.paths[i], &st) == 0 &&
+		    (st.st_size != state->size || st.st_mtim.tv_sec != state->mtime.tv_sec ||
+		     st.st_mtim.tv_nsec != state->mtime.tv_nsec)) {
+			state->last_event = now;
+			state->size = st.st_size;
+			state->mtime = st.st_mtim;
+			wait = WATCH_DEBOUNCE_MS;
+		}
+
+		if (wait > 0) {
+			if (timeout == -1 || wait < timeout)
+				timeout = wait;
+			i++;
+			continue;
+		}
+
+		// move the path from pending to due
+		if (file_list_add(&due, pending->files.paths[i]) != 0) {
+			log_oom();
+			pending->files.paths[i] = NULL;
+		}
+		pending->files.count--;
+		pending->files.paths[i] = pending->files.paths[pending->files.count];
+		pending->states[i] = pending->states[pending->files.count];
+	}
+
+	if (due.count > 0) {
+		process_files(ctx, due.paths, due.count);
+		if (stats_path)
+			sth_stats_write(ctx, stats_path);
+	}
+
+	file_list_free(&due);
+	return timeout;
+}
+
+/*
+ * --watch: processes new videos in the directories as soon as they have
+ * been written, using one client and session for the whole time.
+ */
+static int watch_dirs(struct sth_context *ctx, char **dirs, int n) {
+	struct watch_set ws = { .fd = -1 };
+	struct watch_pending pending = { .files = { 0 } };
+	int r = 0;
+
+	ws.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (ws.fd == -1) {
+		log_err("failed to init inotify: %m");
+		return errno;
+	}
+
+	for (int i = 0; i < n; i++) {
+		r = watch_add_tree(&ws, dirs[i]);
+		if (r != 0)
+			goto finish;
+	}
+
+	struct sigaction sa = { .sa_handler = handle_stop_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	log_info("watching for new videos, press Ctrl+C to stop.");
+
+	int timeout = -1;
+	while (!stop_requested) {
+		struct pollfd pfd = { .fd = ws.fd, .events = POLLIN };
+		if (poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+			log_err("failed to wait for events: %m");
+			r = errno;
+			goto finish;
+		}
+
+		char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t len;
+		while ((len = read(ws.fd, buf, sizeof(buf))) > 0) {
+			for (char *p = buf; p < buf + len; ) {
+				struct inotify_event *ev = (struct inotify_event *) p;
+				p += sizeof(struct inotify_event) + ev->len;
+
+				if (ev->wd < 0 || ev->wd >= ws.capacity || !ws.paths[ev->wd])
+					continue;
+
+				if (ev->mask & IN_IGNORED) {
+					free(ws.paths[ev->wd]);
+					ws.paths[ev->wd] = NULL;
+					continue;
+				}
+
+				if (!ev->len)
+					continue;
+
+				_cleanup_free_ char *path = NULL;
+				if (asprintf(&path, "%s/%s", ws.paths[ev->wd], ev->name) == -1) {
+					r = log_oom();
+					goto finish;
+				}
+
+				if (ev->mask & IN_ISDIR) {
+					// a new directory: watch it and queue the videos already in it,
+					// they are processed once their size and mtime stay the same
+					struct file_list existing = { 0 };
+					int skipped = 0;
+					r = watch_add_tree(&ws, path);
+					if (r == 0)
+						r = scan_dir(AT_FDCWD, path, path, &existing, &skipped);
+					for (int i = 0; r != ENOMEM && i < existing.count; i++)
+						r = watch_queue(&pending, existing.paths[i]);
+					file_list_free(&existing);
+				} else if ((ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) &&
+				           has_extension(ev->name, video_extensions) &&
+				           (options.force_overwrite || !has_subtitle_on_disk(path))) {
+					r = watch_queue(&pending, path);
+				}
+
+				// a directory which can't be watched (or vanished) is logged, but
+				// only running out of memory ends watching
+				if (r == ENOMEM)
+					goto finish;
+				r = 0;
+			}
+		}
+
+		timeout = watch_process_due(ctx, &pending);
+	}
+
+finish:
+	file_list_free(&pending.files);
+	free(pending.states);
+	for (int i = 0; i < ws.capacity; i++)
+		free(ws.paths[i]);
+	free(ws.paths);
+	close(ws.fd);
+
+	return r;
+}
+
+/*
+ * --serve: a connected client. Requests are read into buf until they are
+ * complete; the client is closed after the round in which it hung up, so it
+ * still gets the responses to the requests it sent before.
+ */
+struct serve_client {
+	int fd;
+	unsigned char *buf;
+	size_t len;
+	struct out_buf out;    // responses not sent yet
+	bool eof;
+	bool failed;
+};
+
+struct serve_request {
+	struct serve_client *client;
+	char *frame;
+	const char *path;
+	const char *out;
+	bool best;
+	struct sth_query query;
+	int r;
+	const char *error; // NULL for strerror(r)
+	char *sub_path;
+	int id;
+	int score;
+};
+
+struct serve_queue {
+	struct serve_request *reqs;
+	int count;
+	int capacity;
+};
+
+static struct serve_request *serve_queue_add(struct serve_queue *queue, struct serve_client *client) {
+	if (queue->count == queue->capacity) {
+		int capacity = queue->capacity ? 2 * queue->capacity : 16;
+		struct serve_request *reqs = realloc(queue->reqs, capacity * sizeof(struct serve_request));
+		if (!reqs)
+			return NULL;
+		queue->reqs = reqs;
+		queue->capacity = capacity;
+	}
+
+	struct serve_request *req = &queue->reqs[queue->count++];
+	memset(req, 0, sizeof(*req));
+	req->client = client;
+	return req;
+}
+
+/*
+ * parses the key=value lines of a request, see show_usage().
+ */
+static int serve_parse(struct serve_request *req) {
+	bool have_hash = false;
+	bool have_size = false;
+	char *next;
+
+	for (char *line = req->frame; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (*line == '\0')
+			continue;
+
+		char *value = strchr(line, '=');
+		if (!value) {
+			req->error = "malformed line";
+			return EINVAL;
+		}
+		*value++ = '\0';
+
+		char *end;
+		errno = 0;
+		if (strcmp(line, "path") == 0) {
+			req->path = value;
+		} else if (strcmp(line, "hash") == 0) {
+			req->query.hash = strtoull(value, &end, 16);
+			if (errno != 0 || end == value || *end != '\0' || strlen(value) > 16) {
+				req->error = "invalid hash";
+				return EINVAL;
+			}
+			have_hash = true;
+		} else if (strcmp(line, "size") == 0) {
+			req->query.size = strtoull(value, &end, 10);
+			if (errno != 0 || end == value || *end != '\0') {
+				req->error = "invalid size";
+				return EINVAL;
+			}
+			have_size = true;
+		} else if (strcmp(line, "lang") == 0) {
+			req->query.lang = *value ? value : NULL;
+		} else if (strcmp(line, "policy") == 0) {
+			if (strcmp(value, "best") == 0) {
+				req->best = true;
+			} else if (strcmp(value, "score") != 0) {
+				req->error = "invalid policy";
+				return EINVAL;
+			}
+		} else if (strcmp(line, "out") == 0) {
+			req->out = *value ? value : NULL;
+		} else {
+			req->error = "unknown field";
+			return EINVAL;
+		}
+	}
+
+	if (!req->path || *req->path == '\0') {
+		req->error = "no path";
+		return EINVAL;
+	}
+	if (have_hash != have_size) {
+		req->error = "hash and size must be given together";
+		return EINVAL;
+	}
+
+	// relative paths would be relative to wherever subberthehut was started
+	if (!have_hash && req->path[0] != '/') {
+		req->error = "path must be absolute";
+		return EINVAL;
+	}
+	if (have_hash && !req->out) {
+		req->error = "out is required with hash and size";
+		return EINVAL;
+	}
+	if (req->out && req->out[0] != '/') {
+		req->error = "out must be absolute";
+		return EINVAL;
+	}
+
+	req->query.path = req->path;
+	req->query.hashed = have_hash;
+	return 0;
+}
+
+/*
+ * reads what the client sent and queues its complete requests.
+ */
+static void serve_read(struct serve_client *client, struct serve_queue *queue) {
+	while (!client->eof) {
+		ssize_t n = read(client->fd, client->buf + client->len, 4 + SERVE_REQUEST_MAX - client->len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			return;
+		if (n <= 0) {
+			client->eof = true;
+			return;
+		}
+		client->len += n;
+
+		while (client->len >= 4) {
+			uint32_t len = (uint32_t) client->buf[0] << 24 | (uint32_t) client->buf[1] << 16 |
+			               (uint32_t) client->buf[2] << 8 | client->buf[3];
+			if (len <= SERVE_REQUEST_MAX && client->len < 4 + len)
+				break;
+
+			struct serve_request *req = serve_queue_add(queue, client);
+			if (!req) {
+				log_oom();
+				client->eof = true;
+				return;
+			}
+
+			// the rest of the stream can't be made sense of
+			if (len > SERVE_REQUEST_MAX) {
+				req->r = EMSGSIZE;
+				req->error = "request too large";
+				client->eof = true;
+				return;
+			}
+
+			req->frame = strndup((const char *) client->buf + 4, len);
+			req->r = req->frame ? serve_parse(req) : log_oom();
+
+			client->len -= 4 + len;
+			memmove(client->buf, client->buf + 4 + len, client->len);
+		}
+	}
+}
+
+static int serve_choose(struct sth_context *ctx, struct sth_file *file, void *data) {
+	struct serve_request *req = sth_file_data(file);
+	int n;
+	(void) ctx;
+	(void) data;
+
+	req->r = sth_file_error(file);
+	if (req->r != 0)
+		return req->r;
+
+	struct sth_sub_info *sub_infos = sth_file_results(file, &n);
+	int sel = sth_select(sub_infos, n, req->best ? 0 : min_score);
+	if (sel == -1) {
+		req->error = n == 0 ? "no results" : "no result scores high enough";
+		req->r = ENOENT;
+		return req->r;
+	}
+
+	const struct sth_sub_info *sub_info = &sub_infos[sel];
+	req->sub_path = req->out ? strdup(req->out) : (char *) get_sub_path(req->path, sub_info->filename, NULL);
+	if (!req->sub_path) {
+		req->r = log_oom();
+		return req->r;
+	}
+	req->id = sub_info->id;
+	req->score = sub_info->score;
+
+	req->r = sth_file_choose(file, sub_info, req->sub_path);
+	return req->r;
+}
+
+static void serve_done(struct sth_context *ctx, struct sth_file *file, void *data) {
+	struct serve_request *req = sth_file_data(file);
+	(void) ctx;
+	(void) data;
+
+	req->r = sth_file_error(file);
+}
+
+/*
+ * searches for the queued requests, up to SERVE_BATCH_MAX with a single
+ * request to the server. Requests for the same video and languages, e.g.
+ * from several clients at once, are searched for only once. This blocks:
+ * requests arriving meanwhile wait for the next round.
+ */
+static void serve_process(struct sth_context *ctx, struct serve_queue *queue) {
+	struct sth_callbacks callbacks = {
+		.choose = serve_choose,
+		.file_done = serve_done,
+	};
+	struct sth_query queries[SERVE_BATCH_MAX];
+	int n = 0;
+
+	for (int i = 0; i < queue->count; i++) {
+		struct serve_request *req = &queue->reqs[i];
+		if (req->r == 0) {
+			// in case processing fails before the request is chosen for
+			req->r = ECANCELED;
+			queries[n] = req->query;
+			queries[n].data = req;
+			n++;
+		}
+
+		if (n == SERVE_BATCH_MAX || (n > 0 && i == queue->count - 1)) {
+			sth_process_queries(ctx, queries, n, &callbacks);
+			n = 0;
+		}
+	}
+}
+
+/*
+ * sends as much of the pending responses as the client takes without
+ * blocking, the rest is sent once it is writable again.
+ */
+static void serve_send(struct serve_client *client) {
+	size_t sent = 0;
+
+	while (sent < client->out.len) {
+		ssize_t n = write(client->fd, client->out.data + sent, client->out.len - sent);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			break;
+		if (n == -1) {
+			client->failed = true;
+			return;
+		}
+		sent += n;
+	}
+
+	client->out.len -= sent;
+	memmove(client->out.data, client->out.data + sent, client->out.len);
+}
+
+/*
+ * queues the response to a request: a length like that of the requests,
+ * followed by the status and either the subtitle written or the error.
+ */
+static void serve_respond(struct serve_request *req) {
+	struct serve_client *client = req->client;
+	struct out_buf *out = &client->out;
+	size_t start = out->len;
+
+	if (client->failed)
+		return;
+
+	out_printf(out, "%4s", "");
+	out_printf(out, "status=%d\n", req->r);
+	if (req->r == 0)
+		out_printf(out, "sub=%s\nid=%d\nscore=%d\n", req->sub_path, req->id, req->score);
+	else
+		out_printf(out, "error=%s\n", req->error ? req->error : strerror(req->r));
+
+	if (out->failed) {
+		log_oom();
+		client->failed = true;
+		return;
+	}
+
+	uint32_t len = out->len - start - 4;
+	out->data[start] = len >> 24;
+	out->data[start + 1] = len >> 16;
+	out->data[start + 2] = len >> 8;
+	out->data[start + 3] = len;
+	serve_send(client);
+}
+
+/*
+ * --serve: answers requests on a Unix domain socket, using one client and
+ * session for all of them.
+ */
+static int serve(struct sth_context *ctx, const char *socket_path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct serve_client clients[SERVE_CLIENTS_MAX];
+	struct pollfd pfds[1 + SERVE_CLIENTS_MAX];
+	struct serve_queue queue = { 0 };
+	struct stat st;
+	int nclients = 0;
+	int r = 0;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		log_err("socket path too long: %s", socket_path);
+		return ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd == -1) {
+		log_err("failed to create socket: %m");
+		return errno;
+	}
+
+	// a socket left behind by an earlier run, unless that one still runs
+	if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (probe != -1 && connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+			log_err("already serving on %s.", socket_path);
+			close(probe);
+			close(fd);
+			return EADDRINUSE;
+		}
+		if (probe != -1 && errno == ECONNREFUSED)
+			unlink(socket_path);
+		if (probe != -1)
+			close(probe);
+	}
+
+	// only the user may connect, who may write wherever the clients ask to
+	mode_t mask = umask(0177);
+	r = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	if (r == -1 || listen(fd, SOMAXCONN) == -1) {
+		r = errno;
+		log_err("failed to listen on %s: %s", socket_path, strerror(r));
+		close(fd);
+		return r;
+	}
+
+	struct sigaction sa = { .sa_handler = handle_stop_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	// a client which hung up makes writing fail instead
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	log_info("serving on %s, press Ctrl+C to stop.", socket_path);
+
+	while (!stop_requested) {
+		pfds[0].fd = nclients < SERVE_CLIENTS_MAX ? fd : -1;
+		pfds[0].events = POLLIN;
+		for (int i = 0; i < nclients; i++) {
+			pfds[1 + i].fd = clients[i].fd;
+			pfds[1 + i].events = (clients[i].eof ? 0 : POLLIN) | (clients[i].out.len ? POLLOUT : 0);
+		}
+
+		if (poll(pfds, 1 + nclients, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			r = errno;
+			log_err("failed to wait for requests: %s", strerror(r));
+			break;
+		}
+
+		for (int i = 0; i < nclients; i++) {
+			// POLLERR and POLLHUP make writing fail, so the client is dropped
+			if ((pfds[1 + i].revents & (POLLOUT | POLLERR | POLLHUP)) && clients[i].out.len)
+				serve_send(&clients[i]);
+			if (pfds[1 + i].revents & ~POLLOUT)
+				serve_read(&clients[i], &queue);
+		}
+
+		while ((pfds[0].revents & POLLIN) && nclients < SERVE_CLIENTS_MAX) {
+			int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (client_fd == -1)
+				break;
+
+			struct serve_client *client = &clients[nclients];
+			memset(client, 0, sizeof(*client));
+			client->fd = client_fd;
+			client->buf = malloc(4 + SERVE_REQUEST_MAX);
+			if (!client->buf) {
+				log_oom();
+				close(client_fd);
+				break;
+			}
+			nclients++;
+		}
+
+		if (queue.count > 0) {
+			serve_process(ctx, &queue);
+
+			for (int i = 0; i < queue.count; i++) {
+				serve_respond(&queue.reqs[i]);
+				free(queue.reqs[i].frame);
+				free(queue.reqs[i].sub_path);
+			}
+			queue.count = 0;
+
+			if (stats_path)
+				sth_stats_write(ctx, stats_path);
+		}
+
+		for (int i = 0; i < nclients; ) {
+			// a client which is done sending still gets its responses
+			if ((clients[i].eof && clients[i].out.len == 0) || clients[i].failed) {
+				close(clients[i].fd);
+				free(clients[i].buf);
+				out_free(&clients[i].out);
+				clients[i] = clients[--nclients];
+			} else {
+				i++;
+			}
+		}
+	}
+
+	for (int i = 0; i < nclients; i++) {
+		close(clients[i].fd);
+		free(clients[i].buf);
+		out_free(&clients[i].out);
+	}
+	free(queue.reqs);
+	close(fd);
+	unlink(socket_path);
+
+	return r;
+}
+
+int main(int argc, char *argv[]) {
+	struct sth_context *ctx = NULL;
+	struct file_list files = { 0 };
+	int r = EXIT_SUCCESS;
+
+	// options without a short equivalent
+	enum {
+		OPT_NO_HASH_CACHE = 256,
+		OPT_NO_SEARCH_CACHE,
+		OPT_SEARCH_CACHE_TTL,
+		OPT_MAX_INFLIGHT,
+		OPT_SERVER,
+		OPT_STATS,
+		OPT_RATE_LIMIT,
+		OPT_MIN_SCORE,
+		OPT_TIMEOUT,
+		OPT_CONNECT_TIMEOUT,
+		OPT_HTTP2,
+		OPT_PER_LANGUAGE,
+		OPT_INDEX,
+		OPT_BUILD_INDEX,
+		OPT_NDJSON,
+		OPT_UTF8,
+		OPT_UNIX_NEWLINES,
+		OPT_STRIP_BOM,
+		OPT_BLOB_STORE,
+		OPT_SERVE,
+	};
+
+	sth_options_init(&options);
+
+	// parse options
+	const struct option opts[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"lang", required_argument, NULL, 'l'},
+		{"list-languages", no_argument, NULL, 'L'},
+		{"always-ask", no_argument, NULL, 'a'},
+		{"never-ask", no_argument, NULL, 'n'},
+		{"force", no_argument, NULL, 'f'},
+		{"hash-search-only", no_argument, NULL, 'o'},
+		{"name-search-only", no_argument, NULL, 'O'},
+		{"same-name", no_argument, NULL, 's'},
+		{"per-language", no_argument, NULL, OPT_PER_LANGUAGE},
+		{"ndjson", no_argument, NULL, OPT_NDJSON},
+		{"utf8", no_argument, NULL, OPT_UTF8},
+		{"unix-newlines", no_argument, NULL, OPT_UNIX_NEWLINES},
+		{"strip-bom", no_argument, NULL, OPT_STRIP_BOM},
+		{"blob-store", no_argument, NULL, OPT_BLOB_STORE},
+		{"recursive", no_argument, NULL, 'r'},
+		{"watch", no_argument, NULL, 'w'},
+		{"serve", required_argument, NULL, OPT_SERVE},
+		{"limit", required_argument, NULL, 't'},
+		{"batch-size", required_argument, NULL, 'b'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"no-hash-cache", no_argument, NULL, OPT_NO_HASH_CACHE},
+		{"no-search-cache", no_argument, NULL, OPT_NO_SEARCH_CACHE},
+		{"search-cache-ttl", required_argument, NULL, OPT_SEARCH_CACHE_TTL},
+		{"index", required_argument, NULL, OPT_INDEX},
+		{"build-index", required_argument, NULL, OPT_BUILD_INDEX},
+		{"max-inflight", required_argument, NULL, OPT_MAX_INFLIGHT},
+		{"server", required_argument, NULL, OPT_SERVER},
+		{"timeout", required_argument, NULL, OPT_TIMEOUT},
+		{"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+		{"http2", no_argument, NULL, OPT_HTTP2},
+		{"stats", required_argument, NULL, OPT_STATS},
+		{"rate-limit", required_argument, NULL, OPT_RATE_LIMIT},
+		{"min-score", required_argument, NULL, OPT_MIN_SCORE},
+		{"no-exit-on-fail", no_argument, NULL, 'e'},
+		{"quiet", no_argument, NULL, 'q'},
+		{"version", no_argument, NULL, 'v'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "hl:LanfoOsrwt:b:j:eqv", opts, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			show_usage();
+			return EXIT_SUCCESS;
+
+		case 'l':
+			options.lang = optarg;
+			break;
+
+		case 'L':
+			list_languages = true;
+			break;
+
+		case 'a':
+			always_ask = true;
+			break;
+
+		case 'n':
+			never_ask = true;
+			break;
+
+		case 'f':
+			options.force_overwrite = true;
+			break;
+
+		case 'o':
+			options.hash_search_only = true;
+			options.name_search_only = false;
+			break;
+
+		case 'O':
+			options.name_search_only = true;
+			options.hash_search_only = false;
+			break;
+
+		case 's':
+			same_name = true;
+			break;
+
+		case 'r':
+			recursive = true;
+			break;
+
+		case 'w':
+			watch = true;
+			break;
+
+		case OPT_SERVE:
+			serve_path = optarg;
+			break;
+
+		case 't':
+		{
+			char *endptr = NULL;
+			options.limit = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || options.limit < 1) {
 				log_err("invalid limit: %s", optarg);
 				return EXIT_FAILURE;
 			}
 			break;
 		}
 
+		case 'b':
+		{
+			char *endptr = NULL;
+			options.batch_size = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || options.batch_size < 1) {
+				log_err("invalid batch size: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case 'j':
+		{
+			char *endptr = NULL;
+			options.hash_threads = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || options.hash_threads < 1) {
+				log_err("invalid number of jobs: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_NO_HASH_CACHE:
+			options.use_hash_cache = false;
+			break;
+
+		case OPT_NO_SEARCH_CACHE:
+			options.use_search_cache = false;
+			break;
+
+		case OPT_SEARCH_CACHE_TTL:
+		{
+			char *endptr = NULL;
+			options.search_cache_ttl = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || options.search_cache_ttl < 0) {
+				log_err("invalid search cache TTL: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_MAX_INFLIGHT:
+		{
+			char *endptr = NULL;
+			options.max_inflight = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || options.max_inflight < 1) {
+				log_err("invalid number of requests: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_MIN_SCORE:
+		{
+			char *endptr = NULL;
+			min_score = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || min_score < 0 || min_score > 100) {
+				log_err("invalid minimum score: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_SERVER:
+			options.server_url = optarg;
+			break;
+
+		case OPT_TIMEOUT:
+		{
+			char *endptr = NULL;
+			options.timeout = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || options.timeout < 1) {
+				log_err("invalid timeout: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_CONNECT_TIMEOUT:
+		{
+			char *endptr = NULL;
+			options.connect_timeout = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || options.connect_timeout < 1) {
+				log_err("invalid connect timeout: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
+		case OPT_HTTP2:
+			options.http2 = true;
+			break;
+
+		case OPT_PER_LANGUAGE:
+			per_language = true;
+			break;
+
+		case OPT_INDEX:
+			options.index_path = optarg;
+			break;
+
+		case OPT_NDJSON:
+			ndjson = true;
+			break;
+
+		case OPT_UTF8:
+			options.utf8 = true;
+			break;
+
+		case OPT_UNIX_NEWLINES:
+			options.unix_newlines = true;
+			break;
+
+		case OPT_STRIP_BOM:
+			options.strip_bom = true;
+			break;
+
+		case OPT_BLOB_STORE:
+			options.use_blob_store = true;
+			break;
+
+		case OPT_BUILD_INDEX:
+			build_index_path = optarg;
+			break;
+
+		case OPT_STATS:
+			stats_path = optarg;
+			break;
+
+		case OPT_RATE_LIMIT:
+		{
+			char *endptr = NULL;
+			options.rate_limit = strtol(optarg, &endptr, 10);
+
+			if (*endptr != '\0' || options.rate_limit < 1) {
+				log_err("invalid rate limit: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+
 		case 'e':
-			exit_on_fail = false;
+			options.exit_on_fail = false;
 			break;
 
 		case 'q':
@@ -805,48 +2163,83 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	// check if user has specified at least one file (except for listing languages)
-	if (argc - optind < 1 && !list_languages) {
+	// all languages share one search, so that one language's results can't
+	// take all the places of the others, the limit is per language
+	if (per_language) {
+		if (strcmp(options.lang, "all") == 0) {
+			log_err("warning: --per-language with -l all, the results of some "
+			        "languages may not make it into the limit of %d.", options.limit);
+		} else {
+			int langs = 1;
+			for (const char *l = options.lang; *l; l++)
+				langs += *l == ',';
+			options.limit *= langs;
+		}
+	}
+
+	// a watcher or server runs unattended
+	if (watch || serve_path) {
+		never_ask = true;
+		always_ask = false;
+		options.exit_on_fail = false;
+	}
+
+	sth_set_log(log_message, NULL);
+
+	// building the index needs neither files nor the server
+	if (build_index_path)
+		return sth_build_index(build_index_path) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	// check if user has specified at least one file (except for listing languages and serving)
+	if (argc - optind < 1 && !list_languages && !serve_path) {
 		show_usage();
 		return EXIT_FAILURE;
 	}
 
-	// xmlrpc init
-	xmlrpc_env_init(&env);
-	xmlrpc_client_setup_global_const(&env);
-	// make sure the library doesn't complain about too much data
-	xmlrpc_limit_set(XMLRPC_XML_SIZE_LIMIT_ID, STH_XMLRPC_SIZE_LIMIT);
+	options.stats = stats_path != NULL;
 
-	xmlrpc_client_create(&env, XMLRPC_CLIENT_NO_FLAGS, "subberthehut", VERSION, NULL, 0, &client);
-	if (env.fault_occurred) {
-		log_err("failed to init xmlrpc client: %s (%d)", env.fault_string, env.fault_code);
-		r = env.fault_code;
-		goto finish;
+	// listing the languages needs none of the caches
+	if (list_languages) {
+		options.use_hash_cache = false;
+		options.use_search_cache = false;
+		options.use_blob_store = false;
+		options.index_path = NULL;
 	}
 
-	// login
-	r = login(&token);
+	r = sth_global_init();
+	if (r != 0)
+		return r;
+
+	r = sth_new(&options, &ctx);
 	if (r != 0)
 		goto finish;
 
 	// only list the languages and exit
 	if (list_languages) {
-		r = list_sub_languages();
+		r = sth_list_languages(ctx, print_language, NULL);
 		goto finish;
 	}
 
 	// process files
-	for (int i = optind; i < argc; i++) {
-		char *filepath = argv[i];
-		r = process_file(filepath, token);
-		if (r != 0 && exit_on_fail)
-			goto finish;
+	if (serve_path) {
+		r = serve(ctx, serve_path);
+	} else if (watch) {
+		r = watch_dirs(ctx, &argv[optind], argc - optind);
+	} else if (recursive) {
+		r = collect_files(&argv[optind], argc - optind, &files);
+		if (r == 0 && files.count > 0)
+			r = process_files(ctx, files.paths, files.count);
+	} else {
+		r = process_files(ctx, &argv[optind], argc - optind);
 	}
 
 finish:
-	xmlrpc_env_clean(&env);
-	xmlrpc_client_destroy(client);
-	xmlrpc_client_teardown_global_const();
+	if (ctx && stats_path && sth_stats_write(ctx, stats_path) != 0 && r == EXIT_SUCCESS)
+		r = EXIT_FAILURE;
+	sth_free(ctx);
+	sth_global_cleanup();
+	file_list_free(&files);
+	out_free(&ndjson_out);
 
 	return r;
 }
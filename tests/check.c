@@ -0,0 +1,107 @@
+/*
+ * regression tests of the library, run by make check. They need no server:
+ * the functions under test are static, so the library is included instead
+ * of being linked, like bench/decode.c does.
+ */
+
+#include "../libsubberthehut.c"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+ * a name match may score SCORE_HASH as well (similarity, fps, downloads,
+ * rating and uploader), it must not win over a hash match ranked below it.
+ */
+static void test_select() {
+	struct sth_sub_info subs[] = {
+		{ .id = 1, .score = SCORE_SIMILARITY + SCORE_FPS + SCORE_DOWNLOADS + SCORE_RATING + SCORE_UPLOADER },
+		{ .id = 2, .score = SCORE_HASH - SCORE_BAD, .matched_by_hash = true, .bad = true },
+		{ .id = 3, .score = 10 },
+	};
+
+	CHECK(subs[0].score >= SCORE_HASH);
+	CHECK(sth_select(subs, 3, SCORE_HASH) == 1);
+	CHECK(sth_select(subs, 3, 30) == 1);
+	// above SCORE_HASH, only the score counts
+	CHECK(sth_select(subs, 3, SCORE_HASH + 1) == -1);
+	CHECK(sth_select(subs, 1, SCORE_HASH) == 0);
+	CHECK(sth_select(subs, 1, SCORE_HASH + 1) == -1);
+	// the best regardless
+	CHECK(sth_select(subs, 3, 0) == 0);
+	CHECK(sth_select(subs + 2, 1, SCORE_HASH) == -1);
+	CHECK(sth_select(subs, 0, 0) == -1);
+}
+
+/*
+ * the hash of a file with generated content, which the original
+ * implementation computed as expected.
+ */
+static uint64_t hash_of(size_t size) {
+	char path[] = "/tmp/subberthehut-check.XXXXXX";
+	_cleanup_close_ int fd = mkstemp(path);
+	_cleanup_free_ unsigned char *buf = malloc(size);
+	uint64_t hash = 0;
+	uint64_t filesize;
+	struct stat st;
+
+	if (fd == -1 || !buf)
+		return 0;
+	unlink(path);
+
+	for (size_t i = 0; i < size; i++)
+		buf[i] = i * 7 + 3;
+	if (write_full(fd, buf, size) != 0 || get_hash_and_filesize(fd, &hash, &filesize, &st) != 0 || filesize != size)
+		return 0;
+	return hash;
+}
+
+/*
+ * a file smaller than HASH_CHUNK is summed up once, not as both windows.
+ */
+static void test_hash() {
+	CHECK(hash_of(1000) == 0xf2881daf44da73afULL);
+	// the trailing bytes which don't make up a word don't count
+	CHECK(hash_of(1003) == 0xf2881daf44da73b2ULL);
+	CHECK(hash_of(HASH_CHUNK) == 0x60a0df1f5fa0c000ULL);
+	CHECK(hash_of(200000) == 0x60a0df1f5fa2cd40ULL);
+}
+
+/*
+ * the offsets into the string table of an index are 32-bit.
+ */
+static void test_index_strings() {
+	_cleanup_free_ char *strings = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+	uint32_t offset = 0;
+
+	CHECK(index_add_string(&strings, &size, &capacity, "eng", &offset) == 0 && offset == 0);
+	CHECK(index_add_string(&strings, &size, &capacity, "ger", &offset) == 0 && offset == 4);
+	CHECK(size == 8 && strcmp(strings + 4, "ger") == 0);
+
+	// nothing is allocated or written before the check
+	size = UINT32_MAX - 3;
+	offset = 0;
+	CHECK(index_add_string(&strings, &size, &capacity, "eng", &offset) == EFBIG);
+	CHECK(size == UINT32_MAX - 3 && offset == 0);
+}
+
+int main() {
+	test_select();
+	test_hash();
+	test_index_strings();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed.\n", failures);
+		return EXIT_FAILURE;
+	}
+	puts("all checks passed.");
+	return EXIT_SUCCESS;
+}